@@ -1,9 +1,55 @@
 -- init.sql
 CREATE TABLE IF NOT EXISTS lichess (
     id SERIAL PRIMARY KEY,
-    fen TEXT NOT NULL UNIQUE,
-    white_wins INTEGER NOT NULL,
-    black_wins INTEGER NOT NULL,
-    draws INTEGER NOT NULL,
-    children_moves TEXT[] NOT NULL
+    -- 64-bit hash of the position, and thc's 24 byte compressed board to tell apart
+    -- positions that share a hash
+    position_key BIGINT NOT NULL,
+    board BYTEA NOT NULL,
+    -- the rating band and speed of the games counted in this row (see gameBucket.hpp).
+    -- A position has a row per bucket it was played in
+    bucket SMALLINT NOT NULL,
+    -- only filled in when storeFen=true, for reading the table by hand
+    fen TEXT,
+    white_wins BIGINT NOT NULL,
+    black_wins BIGINT NOT NULL,
+    draws BIGINT NOT NULL
+);
+-- a position has one row per bucket. The flushes merge into it with ON CONFLICT, and lookups
+-- by position_key use the front of it
+CREATE UNIQUE INDEX IF NOT EXISTS lichess_position_index ON lichess (position_key, board, bucket);
+-- every move played from a position, with the results of the games that played it.
+-- move_code is the from square, to square and promotion piece packed into 16 bits
+CREATE TABLE IF NOT EXISTS lichess_moves (
+    parent_key BIGINT NOT NULL,
+    move_code SMALLINT NOT NULL,
+    child_key BIGINT NOT NULL,
+    bucket SMALLINT NOT NULL,
+    white_wins BIGINT NOT NULL,
+    black_wins BIGINT NOT NULL,
+    draws BIGINT NOT NULL,
+    CONSTRAINT lichess_moves_pkey PRIMARY KEY (parent_key, move_code, child_key, bucket)
+);
+-- rare positions and moves that ./parser --prune moved out of the tables above
+CREATE TABLE IF NOT EXISTS lichess_cold (LIKE lichess);
+CREATE TABLE IF NOT EXISTS lichess_moves_cold (LIKE lichess_moves);
+-- one row per prune, with how much it took out
+CREATE TABLE IF NOT EXISTS lichess_prune_log (
+    pruned_at TIMESTAMPTZ NOT NULL DEFAULT now(),
+    min_games INTEGER NOT NULL,
+    cold BOOLEAN NOT NULL,
+    positions BIGINT NOT NULL,
+    moves BIGINT NOT NULL
+);
+-- the months ./parser --apply-delta has added, so none is counted twice
+CREATE TABLE IF NOT EXISTS lichess_applied_months (
+    month TEXT PRIMARY KEY,
+    applied_at TIMESTAMPTZ NOT NULL DEFAULT now(),
+    positions BIGINT NOT NULL,
+    moves BIGINT NOT NULL
+);
+-- the canonicalPositions the tables were loaded with, written by the first flush. Book exports
+-- are marked with it, and an ingest with the other setting is refused
+CREATE TABLE IF NOT EXISTS lichess_metadata (
+    id BOOLEAN PRIMARY KEY DEFAULT true CHECK (id),
+    canonical BOOLEAN NOT NULL
 );
@@ -0,0 +1,85 @@
+// Copyright Andrew Bernal 2023
+#include "bookExport.hpp"
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <tuple>
+#include "openingBook.hpp"
+#include "postgresLoader.hpp"
+
+namespace {
+pqxx::stream_from openQueryStream(pqxx::work& txn, const std::string& query) {
+#if PQXX_VERSION_MAJOR > 7 || (PQXX_VERSION_MAJOR == 7 && PQXX_VERSION_MINOR >= 5)
+    return pqxx::stream_from::query(txn, query);
+#else
+    return pqxx::stream_from(txn, pqxx::from_query, query);
+#endif
+}
+
+int hexDigit(char c) {
+    return c <= '9' ? c - '0' : c - 'a' + 10;
+}
+}  // namespace
+
+bool exportOpeningBook(pqxx::connection& conn, const std::string& path) {
+    // a book marked the wrong way would miss every lookup, so configuration.txt isn't trusted
+    std::optional<bool> canonical = storedCanonical(conn);
+    if (!canonical) {
+        std::cerr << "The database doesn't record its canonicalPositions, see the Readme"
+            << std::endl;
+        return false;
+    }
+    std::FILE* file = std::fopen(path.c_str(), "wb");
+    if (file == nullptr) {
+        std::cerr << "Failed to open " << path << std::endl;
+        return false;
+    }
+    openingBookWriter writer(file, *canonical);
+
+    // both tables are read in one snapshot, in key order, with COPY
+    pqxx::work txn(conn);
+    txn.exec0("SET TRANSACTION ISOLATION LEVEL REPEATABLE READ");
+    {
+        pqxx::stream_from stream = openQueryStream(txn, "SELECT position_key, "
+            "encode(board, 'hex'), bucket, white_wins, black_wins, draws FROM lichess "
+            "ORDER BY position_key, board, bucket");
+        std::tuple<int64_t, std::string, int, int64_t, int64_t, int64_t> row;
+        uint8_t board[24];
+        while (stream >> row) {
+            const std::string& hex = std::get<1>(row);
+            for (size_t i = 0; i < sizeof(board) && 2 * i + 1 < hex.size(); i++) {
+                board[i] = hexDigit(hex[2 * i]) << 4 | hexDigit(hex[2 * i + 1]);
+            }
+            positionStats stats;
+            stats.whiteWins = std::get<3>(row);
+            stats.blackWins = std::get<4>(row);
+            stats.draws = std::get<5>(row);
+            writer.addPosition(std::get<0>(row), board, std::get<2>(row), stats);
+        }
+        stream.complete();
+    }
+    {
+        pqxx::stream_from stream = openQueryStream(txn, "SELECT parent_key, move_code, "
+            "child_key, bucket, white_wins, black_wins, draws FROM lichess_moves "
+            "ORDER BY parent_key, move_code, child_key, bucket");
+        std::tuple<int64_t, int, int64_t, int, int64_t, int64_t, int64_t> row;
+        while (stream >> row) {
+            positionStats stats;
+            stats.whiteWins = std::get<4>(row);
+            stats.blackWins = std::get<5>(row);
+            stats.draws = std::get<6>(row);
+            writer.addMove(std::get<0>(row), static_cast<moveCode>(std::get<1>(row)),
+                std::get<2>(row), std::get<3>(row), stats);
+        }
+        stream.complete();
+    }
+    txn.commit();
+
+    if (!writer.finish()) {
+        std::cerr << "Failed to write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,10 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <pqxx/pqxx>
+#include <string>
+
+// writes the lichess and lichess_moves tables to an opening book file (see openingBook.hpp),
+// so the repertoireBuilder can run from it without postgres. The book is marked with the
+// canonicalPositions recorded in lichess_metadata. False if there isn't one, or the file
+// can't be written
+bool exportOpeningBook(pqxx::connection& conn, const std::string& path);
@@ -0,0 +1,85 @@
+// Copyright Andrew Bernal 2023
+#include "bookStorage.hpp"
+#include <algorithm>
+#include <bitset>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+bookStorage::bookStorage(std::unique_ptr<openingBook> bookInp,
+    const std::vector<gameBucket>& bucketsInp)
+    : positionStorage(bookInp->canonical(), bucketsInp), book(std::move(bookInp)) {}
+
+void bookStorage::flush(const positionAggregate&, const ingestCheckpoint&) {
+    throw std::logic_error("the opening book is read-only");
+}
+
+bool bookStorage::loadCheckpoint(ingestCheckpoint&) {
+    return false;
+}
+
+bool bookStorage::getPosition(const positionKey& key, positionStats& stats) {
+    stats = positionStats();
+    return addBookPosition(book->findPosition(key), wantedBuckets, stats);
+}
+
+std::vector<storedMove> bookStorage::getChildren(int64_t parentKey) {
+    std::vector<storedMove> children;
+    addBookMoves(book->findMoves(parentKey), wantedBuckets, children);
+    return children;
+}
+
+pruneResult bookStorage::prune(int, bool) {
+    throw std::logic_error("the opening book is read-only");
+}
+
+bool bookStorage::applyDelta(const openingBook&, const std::string&) {
+    throw std::logic_error("the opening book is read-only");
+}
+
+std::unique_ptr<positionStorage> openBookStorage(const storageOptions& options) {
+    auto book = std::make_unique<openingBook>();
+    if (!book->open(options.openingBookLocation)) {
+        std::cerr << "Failed to open the opening book " << options.openingBookLocation
+            << std::endl;
+        return nullptr;
+    }
+    return std::make_unique<bookStorage>(std::move(book), options.buckets);
+}
+
+bool addBookPosition(bookPositionRange records, const std::bitset<bucketCount>& wanted,
+    positionStats& stats) {
+    bool found = false;
+    for (const bookPosition& record : records) {
+        if (wanted.test(record.bucket)) {
+            stats.whiteWins += record.whiteWins;
+            stats.blackWins += record.blackWins;
+            stats.draws += record.draws;
+            found = true;
+        }
+    }
+    return found;
+}
+
+void addBookMoves(bookMoveRange records, const std::bitset<bucketCount>& wanted,
+    std::vector<storedMove>& children) {
+    for (const bookMove& record : records) {
+        if (!wanted.test(record.bucket)) {
+            continue;
+        }
+        auto it = std::find_if(children.begin(), children.end(), [&](const storedMove& child) {
+            return child.move == record.move && child.childKey == record.childKey;
+        });
+        if (it == children.end()) {
+            children.push_back({record.move, record.childKey,
+                {record.whiteWins, record.blackWins, record.draws}});
+        } else {
+            it->stats.whiteWins += record.whiteWins;
+            it->stats.blackWins += record.blackWins;
+            it->stats.draws += record.draws;
+        }
+    }
+}
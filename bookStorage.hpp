@@ -0,0 +1,35 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "openingBook.hpp"
+#include "positionStorage.hpp"
+
+// reads an exported opening book (see openingBook.hpp). It can't be written to
+class bookStorage : public positionStorage {
+ public:
+    bookStorage(std::unique_ptr<openingBook> bookInp, const std::vector<gameBucket>& bucketsInp);
+    bool writable() const override { return false; }
+    // an error, the parser checks writable first
+    void flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint) override;
+    bool loadCheckpoint(ingestCheckpoint& checkpoint) override;
+    bool getPosition(const positionKey& key, positionStats& stats) override;
+    std::vector<storedMove> getChildren(int64_t parentKey) override;
+    // an error, like flush
+    pruneResult prune(int minGames, bool keepCold) override;
+    bool applyDelta(const openingBook& delta, const std::string& month) override;
+
+ private:
+    std::unique_ptr<openingBook> book;
+};
+
+std::unique_ptr<positionStorage> openBookStorage(const storageOptions& options);
+
+// add the counts of the records in the wanted buckets to stats, or to children summed by move.
+// For the book, and for the lsm runs, which are books too. False if no record was wanted
+bool addBookPosition(bookPositionRange records, const std::bitset<bucketCount>& wanted,
+    positionStats& stats);
+void addBookMoves(bookMoveRange records, const std::bitset<bucketCount>& wanted,
+    std::vector<storedMove>& children);
@@ -0,0 +1,55 @@
+// Copyright Andrew Bernal 2023
+#include "countMinSketch.hpp"
+#include <algorithm>
+
+namespace {
+// splitmix64 finalizer, with a different seed per row so the rows are independent
+uint64_t mix(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+const uint64_t rowSeeds[] = {0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+    0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL};
+}  // namespace
+
+countMinSketch::countMinSketch(size_t memoryBytes) : width(1) {
+    // the widest power of two whose counters still fit, so width * depth fills the whole
+    // budget when it is a power of two itself (any sketchMemoryMB that is), and more than
+    // half of it otherwise
+    while (width * 2 * depth <= memoryBytes) {
+        width *= 2;
+    }
+    // value initialized, so every counter starts at zero
+    counters = std::make_unique<std::atomic<uint8_t>[]>(width * depth);
+}
+
+size_t countMinSketch::slot(int64_t key, int row) const {
+    return row * width + (mix(static_cast<uint64_t>(key) ^ rowSeeds[row]) & (width - 1));
+}
+
+void countMinSketch::add(int64_t key) {
+    adds.fetch_add(1, std::memory_order_relaxed);
+    for (int row = 0; row < depth; row++) {
+        std::atomic<uint8_t>& counter = counters[slot(key, row)];
+        // a saturated counter is only read, so the positions every game goes through don't
+        // bounce their cache lines between the threads
+        uint8_t value = counter.load(std::memory_order_relaxed);
+        while (value != maxCount && !counter.compare_exchange_weak(value, value + 1,
+            std::memory_order_relaxed)) {
+        }
+    }
+}
+
+unsigned int countMinSketch::estimate(int64_t key) const {
+    unsigned int smallest = maxCount;
+    for (int row = 0; row < depth; row++) {
+        smallest = std::min<unsigned int>(smallest,
+            counters[slot(key, row)].load(std::memory_order_relaxed));
+    }
+    return smallest;
+}
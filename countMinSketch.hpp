@@ -0,0 +1,32 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// estimates how many times each key was added, in a fixed amount of memory however many keys
+// there are. An estimate is never below the real count; it is above it when every row's
+// counter is shared with other keys, which gets less likely the wider the rows are.
+// The counters saturate at 255, since all that is asked is whether a key reached a threshold
+class countMinSketch {
+ public:
+    explicit countMinSketch(size_t memoryBytes);
+    // safe to call from many threads at once
+    void add(int64_t key);
+    // at least the number of times key was added, up to 255
+    unsigned int estimate(int64_t key) const;
+    uint64_t total() const { return adds.load(); }
+
+    static constexpr unsigned int maxCount = 255;
+
+ private:
+    static constexpr int depth = 4;
+    // the counter of key in row
+    size_t slot(int64_t key, int row) const;
+
+    // a power of two, so a slot is a mask instead of a division
+    size_t width;
+    std::unique_ptr<std::atomic<uint8_t>[]> counters;
+    std::atomic<uint64_t> adds{0};
+};
@@ -0,0 +1,85 @@
+// Copyright Andrew Bernal 2023
+#include "gameBucket.hpp"
+#include <algorithm>
+#include <charconv>
+#include <iterator>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace {
+const int firstBandRating = 1200;
+const int bandWidth = 200;
+
+int ratingBand(int averageRating) {
+    if (averageRating < firstBandRating) {
+        return 0;
+    }
+    return std::min(ratingBandCount - 1, 1 + (averageRating - firstBandRating) / bandWidth);
+}
+}  // namespace
+
+gameSpeed speedFromTimeControl(std::string_view timeControl) {
+    int base = 0, increment = 0;
+    const char* end = timeControl.data() + timeControl.size();
+    auto [plus, baseError] = std::from_chars(timeControl.data(), end, base);
+    if (baseError != std::errc() || plus == end || *plus != '+' ||
+        std::from_chars(plus + 1, end, increment).ec != std::errc()) {
+        return gameSpeed::correspondence;
+    }
+    // lichess estimates a game as 40 moves
+    int estimate = base + 40 * increment;
+    if (estimate < 30) {
+        return gameSpeed::ultraBullet;
+    } else if (estimate < 180) {
+        return gameSpeed::bullet;
+    } else if (estimate < 480) {
+        return gameSpeed::blitz;
+    } else if (estimate < 1500) {
+        return gameSpeed::rapid;
+    }
+    return gameSpeed::classical;
+}
+
+bool speedFromName(std::string_view name, gameSpeed& speed) {
+    const std::string_view names[] = {"ultraBullet", "bullet", "blitz", "rapid", "classical",
+        "correspondence"};
+    for (size_t i = 0; i < std::size(names); i++) {
+        if (name == names[i]) {
+            speed = static_cast<gameSpeed>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::vector<gameSpeed> speedsFromList(const std::string& list) {
+    std::vector<gameSpeed> speeds;
+    std::stringstream ss(list);
+    std::string name;
+    gameSpeed speed;
+    while (std::getline(ss, name, ',')) {
+        if (speedFromName(name, speed)) {
+            speeds.push_back(speed);
+        }
+    }
+    return speeds;
+}
+
+gameBucket makeBucket(int ratingSum, gameSpeed speed) {
+    return ratingBand(ratingSum / 2) * speedCount + static_cast<int>(speed);
+}
+
+std::vector<gameBucket> bucketsFor(int minRating, int maxRating,
+    const std::vector<gameSpeed>& speeds) {
+    std::vector<gameBucket> buckets;
+    for (int band = ratingBand(minRating); band <= ratingBand(maxRating); band++) {
+        for (int speed = 0; speed < speedCount; speed++) {
+            if (speeds.empty() || std::find(speeds.begin(), speeds.end(),
+                static_cast<gameSpeed>(speed)) != speeds.end()) {
+                buckets.push_back(band * speedCount + speed);
+            }
+        }
+    }
+    return buckets;
+}
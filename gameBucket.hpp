@@ -0,0 +1,31 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// lichess' speed classes, from the estimated game duration of the TimeControl tag
+enum class gameSpeed : uint8_t { ultraBullet, bullet, blitz, rapid, classical, correspondence };
+constexpr int speedCount = 6;
+
+// "180+2" -> blitz. Anything that isn't base+increment is treated as correspondence
+gameSpeed speedFromTimeControl(std::string_view timeControl);
+// parses "bullet", "blitz", ... returns false for an unknown name
+bool speedFromName(std::string_view name, gameSpeed& speed);
+// a comma separated list of speed names. Unknown names are skipped
+std::vector<gameSpeed> speedsFromList(const std::string& list);
+
+// The games of a position are counted separately per rating band and speed, so one ingest
+// serves a repertoire against any group of players. Band 0 is an average rating below 1200,
+// then one band per 200 points, up to 2600 and above
+using gameBucket = uint8_t;
+constexpr int ratingBandCount = 9;
+constexpr int bucketCount = ratingBandCount * speedCount;
+
+// ratingSum is white's plus black's rating
+gameBucket makeBucket(int ratingSum, gameSpeed speed);
+// the buckets of the bands that overlap minRating..maxRating, for the given speeds (every
+// speed if empty)
+std::vector<gameBucket> bucketsFor(int minRating, int maxRating,
+    const std::vector<gameSpeed>& speeds);
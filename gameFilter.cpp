@@ -0,0 +1,68 @@
+// Copyright Andrew Bernal 2023
+#include "gameFilter.hpp"
+#include <algorithm>
+#include <charconv>
+#include <sstream>
+#include <string>
+#include "positionAggregate.hpp"
+
+bool gameFilter::configure(const std::string& line) {
+    std::string value = line.substr(line.find("=") + 1);
+    if (line.find("minAverageRating") != std::string::npos) {
+        minAverageRating = std::stoi(value);
+    } else if (line.find("speeds") != std::string::npos) {
+        speeds = speedsFromList(value);
+    } else if (line.find("variants") != std::string::npos) {
+        variants.clear();
+        std::stringstream ss(value);
+        std::string name;
+        while (std::getline(ss, name, ',')) {
+            variants.push_back(name);
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool gameFilter::accepts(const pgnGame& game, double& avgRating) const {
+    if (!variants.empty()) {
+        std::string_view variant = game.tag("Variant");
+        if (variant.empty()) {
+            variant = "Standard";
+        }
+        if (std::find(variants.begin(), variants.end(), variant) == variants.end()) {
+            return false;
+        }
+    }
+
+    // an unfinished game ("*") counts for none of the results, it would only leave rows of zeros
+    if (resultFromTag(game.tag("Result")) == unknownResult) {
+        return false;
+    }
+
+    // a "?" elo means the game can't be placed in a rating band
+    std::string_view whiteEloString = game.tag("WhiteElo");
+    std::string_view blackEloString = game.tag("BlackElo");
+    int whiteElo, blackElo;
+    if (std::from_chars(whiteEloString.data(), whiteEloString.data() + whiteEloString.size(),
+        whiteElo).ec != std::errc() ||
+        std::from_chars(blackEloString.data(), blackEloString.data() + blackEloString.size(),
+        blackElo).ec != std::errc()) {
+        return false;
+    }
+    // avgRating is useful, as it lets us skip parsing entries below a certain rating.
+    // skipping entries means the output file / database can be 90% smaller
+    avgRating = (whiteElo + blackElo) / 2.0;
+    if (avgRating <= minAverageRating) {
+        return false;
+    }
+
+    if (!speeds.empty()) {
+        gameSpeed speed = speedFromTimeControl(game.tag("TimeControl"));
+        if (std::find(speeds.begin(), speeds.end(), speed) == speeds.end()) {
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,24 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include "gameBucket.hpp"
+#include "pgnReader.hpp"
+
+// decides from the headers alone whether a game is worth replaying. Games without a result
+// are never replayed.
+// The settings come from configuration.txt
+struct gameFilter {
+    int minAverageRating = 0;
+    // empty accepts every speed
+    std::vector<gameSpeed> speeds;
+    // a game without a Variant tag is Standard. Empty accepts every variant
+    std::vector<std::string> variants = {"Standard"};
+
+    // reads minAverageRating=, speeds= and variants= lines (lists are comma separated).
+    // Returns false for a line that isn't a filter setting
+    bool configure(const std::string& line);
+    // avgRating is set to the players' average rating, when the game has both
+    bool accepts(const pgnGame& game, double& avgRating) const;
+};
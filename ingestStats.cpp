@@ -0,0 +1,120 @@
+// Copyright Andrew Bernal 2023
+#include "ingestStats.hpp"
+#include <algorithm>
+#include <string>
+#include <utility>
+
+namespace {
+double perSecond(uint64_t amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0;
+}
+
+std::string histogramJson(const latencyHistogram& histogram) {
+    uint64_t mean = histogram.count ? histogram.totalMicros / histogram.count : 0;
+    return "{\"count\":" + std::to_string(histogram.count) +
+        ",\"meanUs\":" + std::to_string(mean) +
+        ",\"p50Us\":" + std::to_string(histogram.percentileMicros(0.5)) +
+        ",\"p99Us\":" + std::to_string(histogram.percentileMicros(0.99)) +
+        ",\"maxUs\":" + std::to_string(histogram.maxMicros) + "}";
+}
+}  // namespace
+
+void latencyHistogram::record(std::chrono::steady_clock::duration elapsed) {
+    uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+    size_t bucket = 0;
+    while (bucket + 1 < buckets.size() && (uint64_t(1) << bucket) <= micros) {
+        bucket++;
+    }
+    buckets[bucket]++;
+    count++;
+    totalMicros += micros;
+    maxMicros = std::max(maxMicros, micros);
+}
+
+void latencyHistogram::merge(const latencyHistogram& other) {
+    for (size_t i = 0; i < buckets.size(); i++) {
+        buckets[i] += other.buckets[i];
+    }
+    count += other.count;
+    totalMicros += other.totalMicros;
+    maxMicros = std::max(maxMicros, other.maxMicros);
+}
+
+uint64_t latencyHistogram::percentileMicros(double fraction) const {
+    uint64_t wanted = static_cast<uint64_t>(count * fraction);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen > wanted) {
+            return std::min(uint64_t(1) << i, maxMicros);
+        }
+    }
+    return maxMicros;
+}
+
+void ingestCounters::merge(const ingestCounters& other) {
+    games += other.games;
+    acceptedGames += other.acceptedGames;
+    rejectedGames += other.rejectedGames;
+    positions += other.positions;
+    flushes += other.flushes;
+    flushedRows += other.flushedRows;
+    read.merge(other.read);
+    parse.merge(other.parse);
+    replay.merge(other.replay);
+    flush.merge(other.flush);
+}
+
+ingestStats::ingestStats(std::ostream& outInp, std::chrono::seconds intervalInp,
+    std::function<uint64_t()> bytesReadInp)
+    : out(outInp), interval(intervalInp), bytesRead(std::move(bytesReadInp)),
+    startTime(std::chrono::steady_clock::now()), lastTime(startTime) {
+    reporter = std::thread([this] {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopped.wait_for(lock, interval, [this] { return stopping; })) {
+            report();
+        }
+        report();
+    });
+}
+
+ingestStats::~ingestStats() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stopped.notify_all();
+    reporter.join();
+}
+
+void ingestStats::add(const ingestCounters& counters) {
+    std::lock_guard<std::mutex> lock(mutex);
+    total.merge(counters);
+}
+
+void ingestStats::report() {
+    // totals since the start, and rates since the last line
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::chrono::duration<double>(now - startTime).count();
+    double seconds = std::chrono::duration<double>(now - lastTime).count();
+    uint64_t bytes = bytesRead();
+    out << "{\"elapsedSeconds\":" << elapsed
+        << ",\"bytes\":" << bytes
+        << ",\"bytesPerSecond\":" << perSecond(bytes - lastBytes, seconds)
+        << ",\"games\":" << total.games
+        << ",\"gamesPerSecond\":" << perSecond(total.games - last.games, seconds)
+        << ",\"acceptedGames\":" << total.acceptedGames
+        << ",\"rejectedGames\":" << total.rejectedGames
+        << ",\"positions\":" << total.positions
+        << ",\"positionsPerSecond\":" << perSecond(total.positions - last.positions, seconds)
+        << ",\"flushes\":" << total.flushes
+        << ",\"flushedRows\":" << total.flushedRows
+        << ",\"read\":" << histogramJson(total.read)
+        << ",\"parse\":" << histogramJson(total.parse)
+        << ",\"replay\":" << histogramJson(total.replay)
+        << ",\"flush\":" << histogramJson(total.flush)
+        << "}" << std::endl;
+    last = total;
+    lastTime = now;
+    lastBytes = bytes;
+}
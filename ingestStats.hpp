@@ -0,0 +1,89 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+// how long something took, in power of two microsecond buckets
+struct latencyHistogram {
+    // bucket i counts latencies below 2^i microseconds
+    std::array<uint64_t, 32> buckets{};
+    uint64_t count = 0;
+    uint64_t totalMicros = 0;
+    uint64_t maxMicros = 0;
+
+    void record(std::chrono::steady_clock::duration elapsed);
+    void merge(const latencyHistogram& other);
+    // upper bound of the bucket the given fraction of latencies fall under
+    uint64_t percentileMicros(double fraction) const;
+};
+
+// times a scope into a histogram
+class scopeTimer {
+ public:
+    explicit scopeTimer(latencyHistogram& histogramInp)
+        : histogram(histogramInp), start(std::chrono::steady_clock::now()) {}
+    ~scopeTimer() { histogram.record(std::chrono::steady_clock::now() - start); }
+
+ private:
+    latencyHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+};
+
+// what has happened during an ingest. Threads fill their own copy and add it to ingestStats,
+// so nothing here needs to be atomic
+struct ingestCounters {
+    uint64_t games = 0;
+    uint64_t acceptedGames = 0;
+    uint64_t rejectedGames = 0;
+    // half-moves replayed (or read back from the post file)
+    uint64_t positions = 0;
+    uint64_t flushes = 0;
+    uint64_t flushedRows = 0;
+    // reading a chunk of input, including decompression
+    latencyHistogram read;
+    // splitting a game into headers and moves, and filtering it
+    latencyHistogram parse;
+    // replaying the moves of an accepted game
+    latencyHistogram replay;
+    // writing a batch to the database
+    latencyHistogram flush;
+
+    void merge(const ingestCounters& other);
+};
+
+// collects the counters of every thread and writes them as one JSON object per line every
+// interval, so a run can be followed (or plotted) while it is going. Comparing the read,
+// replay and flush times shows whether the disk, the CPU or postgres is holding it back
+class ingestStats {
+ public:
+    // bytesRead is asked for the input position, from the reporting thread
+    ingestStats(std::ostream& outInp, std::chrono::seconds intervalInp,
+        std::function<uint64_t()> bytesReadInp);
+    // writes a final line
+    ~ingestStats();
+    void add(const ingestCounters& counters);
+
+ private:
+    void report();
+
+    std::ostream& out;
+    std::chrono::seconds interval;
+    std::function<uint64_t()> bytesRead;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point lastTime;
+    ingestCounters total;
+    // what the rates of the last line were measured from
+    ingestCounters last;
+    uint64_t lastBytes = 0;
+    bool stopping = false;
+    std::mutex mutex;
+    std::condition_variable stopped;
+    std::thread reporter;
+};
@@ -0,0 +1,574 @@
+// Copyright Andrew Bernal 2023
+#include "lsmStorage.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace {
+// runs of a level are merged once there are this many, so every level holds fewer
+const size_t mergeWidth = 4;
+// flushes wait while there are this many runs, instead of making every read slower
+const size_t maxRuns = 32;
+
+bool samePosition(const bookPosition& a, const bookPosition& b) {
+    return a.key == b.key && std::memcmp(a.board, b.board, sizeof(a.board)) == 0;
+}
+
+bool positionBefore(const bookPosition& a, const bookPosition& b) {
+    if (a.key != b.key) {
+        return a.key < b.key;
+    }
+    int board = std::memcmp(a.board, b.board, sizeof(a.board));
+    return board != 0 ? board < 0 : a.bucket < b.bucket;
+}
+
+bool sameMove(const bookMove& a, const bookMove& b) {
+    return a.parentKey == b.parentKey && a.move == b.move && a.childKey == b.childKey;
+}
+
+bool moveBefore(const bookMove& a, const bookMove& b) {
+    return std::tie(a.parentKey, a.move, a.childKey, a.bucket) <
+        std::tie(b.parentKey, b.move, b.childKey, b.bucket);
+}
+
+// walks the runs' records side by side in sorted order, and writes each record once with the
+// counts of every run that has it
+template <typename Record, typename Before, typename Write>
+void mergeRecords(std::vector<std::pair<const Record*, const Record*>> cursors, Before before,
+    Write write) {
+    while (true) {
+        const Record* smallest = nullptr;
+        for (const auto& [next, end] : cursors) {
+            if (next != end && (smallest == nullptr || before(*next, *smallest))) {
+                smallest = next;
+            }
+        }
+        if (smallest == nullptr) {
+            return;
+        }
+        Record sum = *smallest;
+        sum.whiteWins = 0;
+        sum.blackWins = 0;
+        sum.draws = 0;
+        for (auto& [next, end] : cursors) {
+            if (next != end && !before(sum, *next)) {
+                sum.whiteWins += next->whiteWins;
+                sum.blackWins += next->blackWins;
+                sum.draws += next->draws;
+                next++;
+            }
+        }
+        write(sum);
+    }
+}
+
+positionStats recordStats(const bookPosition& record) {
+    return {record.whiteWins, record.blackWins, record.draws};
+}
+
+positionStats recordStats(const bookMove& record) {
+    return {record.whiteWins, record.blackWins, record.draws};
+}
+
+void addStats(positionStats& into, const positionStats& from) {
+    into.whiteWins += from.whiteWins;
+    into.blackWins += from.blackWins;
+    into.draws += from.draws;
+}
+
+void syncPath(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+}
+}  // namespace
+
+lsmStorage::lsmStorage(const storageOptions& options)
+    : positionStorage(options.canonical, options.buckets), directory(options.lsmLocation),
+    source(options.source), ingest(options.ingest) {}
+
+lsmStorage::~lsmStorage() {
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    changed.notify_all();
+    if (merger.joinable()) {
+        merger.join();
+    }
+}
+
+void lsmStorage::open() {
+    std::ifstream manifest(directory + "/MANIFEST");
+    std::set<std::string> live;
+    bool hasCanonical = false;
+    bool manifestCanonical = false;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        std::istringstream fields(line);
+        std::string kind;
+        fields >> kind;
+        if (kind == "canonical") {
+            fields >> manifestCanonical;
+            hasCanonical = true;
+        } else if (kind == "next") {
+            fields >> nextId;
+        } else if (kind == "run") {
+            auto run = std::make_shared<lsmRun>();
+            fields >> run->id >> run->level;
+            run->path = directory + "/run-" + std::to_string(run->id) + ".book";
+            if (!run->book.open(run->path)) {
+                throw std::runtime_error("Failed to open " + run->path);
+            }
+            live.insert(run->path);
+            runs.push_back(run);
+        } else if (kind == "checkpoint") {
+            // the source is last, it can have spaces in it
+            ingestCheckpoint checkpoint;
+            std::string name;
+            fields >> checkpoint.byteOffset >> checkpoint.games >> checkpoint.postBytes;
+            fields.get();
+            std::getline(fields, name);
+            checkpoints[name] = checkpoint;
+        } else if (kind == "applied") {
+            std::string month;
+            fields.get();
+            std::getline(fields, month);
+            appliedMonths.insert(month);
+        }
+    }
+    if (hasCanonical && !runs.empty()) {
+        if (ingest && manifestCanonical != canonicalKeys) {
+            throw std::runtime_error(directory + " was built with canonicalPositions=" +
+                (manifestCanonical ? "true" : "false"));
+        }
+        // like a book, the store decides how the builder makes its keys
+        canonicalKeys = manifestCanonical;
+    }
+    if (!ingest) {
+        return;
+    }
+
+    std::filesystem::create_directories(directory);
+    for (const auto& entry : std::filesystem::directory_iterator(directory)) {
+        std::string path = entry.path().string();
+        if (entry.path().filename().string().rfind("run-", 0) == 0 && live.count(path) == 0) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+    merger = std::thread([this] { mergeLoop(); });
+}
+
+void lsmStorage::flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return mergeError || runs.size() < maxRuns; });
+        if (mergeError) {
+            std::rethrow_exception(mergeError);
+        }
+    }
+
+    // sort the memtable. The database key is worked out once per position, not per comparison
+    using positionEntry = std::pair<const bucketedKey, positionStats>;
+    std::vector<std::pair<int64_t, const positionEntry*>> positions;
+    positions.reserve(aggregate.positions.size());
+    for (const positionEntry& entry : aggregate.positions) {
+        positions.push_back({databaseKey(entry.first.key), &entry});
+    }
+    std::sort(positions.begin(), positions.end(), [](const auto& a, const auto& b) {
+        if (a.first != b.first) {
+            return a.first < b.first;
+        }
+        const bucketedKey& aKey = a.second->first;
+        const bucketedKey& bKey = b.second->first;
+        int board = std::memcmp(aKey.key.board.storage, bKey.key.board.storage,
+            sizeof(aKey.key.board.storage));
+        return board != 0 ? board < 0 : aKey.bucket < bKey.bucket;
+    });
+    using moveEntry = std::pair<const moveEdge, positionStats>;
+    std::vector<const moveEntry*> moves;
+    moves.reserve(aggregate.moves.size());
+    for (const moveEntry& entry : aggregate.moves) {
+        moves.push_back(&entry);
+    }
+    std::sort(moves.begin(), moves.end(), [](const moveEntry* a, const moveEntry* b) {
+        return std::tie(a->first.parentKey, a->first.move, a->first.childKey, a->first.bucket) <
+            std::tie(b->first.parentKey, b->first.move, b->first.childKey, b->first.bucket);
+    });
+
+    std::shared_ptr<lsmRun> run = writeRun(0, [&](openingBookWriter& writer) {
+        for (const auto& [key, entry] : positions) {
+            writer.addPosition(key, entry->first.key.board.storage, entry->first.bucket,
+                entry->second);
+        }
+        for (const moveEntry* entry : moves) {
+            const moveEdge& edge = entry->first;
+            writer.addMove(edge.parentKey, edge.move, edge.childKey, edge.bucket, entry->second);
+        }
+    });
+
+    std::lock_guard<std::mutex> lock(mutex);
+    runs.push_back(run);
+    checkpoints[source] = checkpoint;
+    saveManifest();
+    changed.notify_all();
+}
+
+void lsmStorage::finish() {
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return mergeError || (!merging && dueMerge().empty()); });
+    if (mergeError) {
+        std::rethrow_exception(mergeError);
+    }
+}
+
+bool lsmStorage::loadCheckpoint(ingestCheckpoint& checkpoint) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = checkpoints.find(source);
+    if (it == checkpoints.end()) {
+        return false;
+    }
+    checkpoint = it->second;
+    return true;
+}
+
+bool lsmStorage::getPosition(const positionKey& key, positionStats& stats) {
+    // every run has its share of the counts
+    bool found = false;
+    stats = positionStats();
+    for (const std::shared_ptr<lsmRun>& run : liveRuns()) {
+        found |= addBookPosition(run->book.findPosition(key), wantedBuckets, stats);
+    }
+    return found;
+}
+
+std::vector<storedMove> lsmStorage::getChildren(int64_t parentKey) {
+    std::vector<storedMove> children;
+    for (const std::shared_ptr<lsmRun>& run : liveRuns()) {
+        addBookMoves(run->book.findMoves(parentKey), wantedBuckets, children);
+    }
+    return children;
+}
+
+void lsmStorage::mergeLoop() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        std::vector<std::shared_ptr<lsmRun>> inputs;
+        // prune merges everything itself, and sets merging while it does
+        changed.wait(lock, [&] {
+            return stopping || (!merging && !(inputs = dueMerge()).empty());
+        });
+        if (stopping) {
+            return;
+        }
+        merging = true;
+        lock.unlock();
+
+        std::shared_ptr<lsmRun> merged;
+        try {
+            pruneResult dropped;
+            merged = mergeRuns(inputs, [](const positionStats&) { return true; }, dropped);
+        } catch (...) {
+            lock.lock();
+            mergeError = std::current_exception();
+            merging = false;
+            changed.notify_all();
+            return;
+        }
+
+        lock.lock();
+        replaceRuns(inputs, merged);
+        merging = false;
+        changed.notify_all();
+    }
+}
+
+bool lsmStorage::applyDelta(const openingBook& delta, const std::string& month) {
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return mergeError || runs.size() < maxRuns; });
+        if (mergeError) {
+            std::rethrow_exception(mergeError);
+        }
+        if (appliedMonths.count(month) != 0) {
+            return false;
+        }
+    }
+    // the delta is already a sorted run, so it joins the store as one without being read.
+    // A hard link costs nothing, a copy is only needed if it is on another filesystem
+    auto run = std::make_shared<lsmRun>();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        run->id = nextId++;
+    }
+    run->path = directory + "/run-" + std::to_string(run->id) + ".book";
+    std::string temporary = run->path + ".tmp";
+    std::error_code linkError;
+    std::filesystem::create_hard_link(delta.path(), temporary, linkError);
+    if (linkError) {
+        std::filesystem::copy_file(delta.path(), temporary);
+        syncPath(temporary);
+    }
+    std::filesystem::rename(temporary, run->path);
+    if (!run->book.open(run->path)) {
+        throw std::runtime_error("Failed to open " + run->path);
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // checked again, in case another thread applied it while the run was linked
+    if (!appliedMonths.insert(month).second) {
+        std::remove(run->path.c_str());
+        return false;
+    }
+    runs.push_back(run);
+    // the run and the month are in the same manifest, so they are applied together
+    saveManifest();
+    changed.notify_all();
+    return true;
+}
+
+void lsmStorage::exportBook(const std::string& path) {
+    std::vector<std::shared_ptr<lsmRun>> inputs;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return mergeError || !merging; });
+        if (mergeError) {
+            std::rethrow_exception(mergeError);
+        }
+        merging = true;
+        inputs = runs;
+    }
+    try {
+        pruneResult dropped;
+        std::shared_ptr<lsmRun> merged = mergeRuns(inputs, [](const positionStats&) {
+            return true;
+        }, dropped);
+        std::filesystem::rename(merged->path, path);
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        merging = false;
+        changed.notify_all();
+        throw;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    merging = false;
+    changed.notify_all();
+}
+
+pruneResult lsmStorage::prune(int minGames, bool keepCold) {
+    // a record's count is spread over the runs, so they all have to be merged to know it
+    std::vector<std::shared_ptr<lsmRun>> inputs;
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [this] { return mergeError || !merging; });
+        if (mergeError) {
+            std::rethrow_exception(mergeError);
+        }
+        merging = true;
+        inputs = runs;
+    }
+    pruneResult pruned;
+    std::shared_ptr<lsmRun> merged;
+    try {
+        merged = mergeRuns(inputs, [&](const positionStats& stats) {
+            return stats.total() >= minGames;
+        }, pruned);
+        if (keepCold) {
+            pruneResult kept;
+            std::shared_ptr<lsmRun> cold = mergeRuns(inputs, [&](const positionStats& stats) {
+                return stats.total() < minGames;
+            }, kept);
+            std::filesystem::rename(cold->path, directory + "/cold-" +
+                std::to_string(cold->id) + ".book");
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        merging = false;
+        changed.notify_all();
+        throw;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    replaceRuns(inputs, merged);
+    merging = false;
+    changed.notify_all();
+    return pruned;
+}
+
+std::vector<std::shared_ptr<lsmRun>> lsmStorage::dueMerge() const {
+    std::map<int, std::vector<std::shared_ptr<lsmRun>>> levels;
+    for (const std::shared_ptr<lsmRun>& run : runs) {
+        levels[run->level].push_back(run);
+    }
+    for (auto& [level, levelRuns] : levels) {
+        if (levelRuns.size() >= mergeWidth) {
+            levelRuns.resize(mergeWidth);
+            return levelRuns;
+        }
+    }
+    return {};
+}
+
+std::shared_ptr<lsmRun> lsmStorage::mergeRuns(
+    const std::vector<std::shared_ptr<lsmRun>>& inputs,
+    const std::function<bool(const positionStats&)>& keep, pruneResult& dropped) {
+    int level = 0;
+    std::vector<std::pair<const bookPosition*, const bookPosition*>> positionCursors;
+    std::vector<std::pair<const bookMove*, const bookMove*>> moveCursors;
+    for (const std::shared_ptr<lsmRun>& run : inputs) {
+        level = std::max(level, run->level + 1);
+        const openingBook& book = run->book;
+        positionCursors.push_back({book.positionData(),
+            book.positionData() + book.positionCount()});
+        moveCursors.push_back({book.moveData(), book.moveData() + book.moveCount()});
+    }
+    return writeRun(level, [&](openingBookWriter& writer) {
+        // keep is asked about the total over every bucket, so the records of a position (or
+        // a move) are held back until the next one starts
+        std::vector<bookPosition> position;
+        auto writePosition = [&] {
+            positionStats total;
+            for (const bookPosition& record : position) {
+                addStats(total, recordStats(record));
+            }
+            for (const bookPosition& record : position) {
+                if (keep(total)) {
+                    writer.addPosition(record.key, record.board, record.bucket,
+                        recordStats(record));
+                } else {
+                    dropped.positions++;
+                }
+            }
+            position.clear();
+        };
+        mergeRecords(positionCursors, positionBefore, [&](const bookPosition& record) {
+            if (!position.empty() && !samePosition(position[0], record)) {
+                writePosition();
+            }
+            position.push_back(record);
+        });
+        writePosition();
+
+        std::vector<bookMove> move;
+        auto writeMove = [&] {
+            positionStats total;
+            for (const bookMove& record : move) {
+                addStats(total, recordStats(record));
+            }
+            for (const bookMove& record : move) {
+                if (keep(total)) {
+                    writer.addMove(record.parentKey, record.move, record.childKey,
+                        record.bucket, recordStats(record));
+                } else {
+                    dropped.moves++;
+                }
+            }
+            move.clear();
+        };
+        mergeRecords(moveCursors, moveBefore, [&](const bookMove& record) {
+            if (!move.empty() && !sameMove(move[0], record)) {
+                writeMove();
+            }
+            move.push_back(record);
+        });
+        writeMove();
+    });
+}
+
+void lsmStorage::replaceRuns(const std::vector<std::shared_ptr<lsmRun>>& inputs,
+    const std::shared_ptr<lsmRun>& merged) {
+    for (const std::shared_ptr<lsmRun>& input : inputs) {
+        runs.erase(std::find(runs.begin(), runs.end(), input));
+    }
+    runs.push_back(merged);
+    saveManifest();
+    // readers that still have the old runs keep them mapped until they are done
+    for (const std::shared_ptr<lsmRun>& input : inputs) {
+        std::remove(input->path.c_str());
+    }
+}
+
+std::shared_ptr<lsmRun> lsmStorage::writeRun(int level,
+    const std::function<void(openingBookWriter&)>& fill) {
+    auto run = std::make_shared<lsmRun>();
+    run->level = level;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        run->id = nextId++;
+    }
+    run->path = directory + "/run-" + std::to_string(run->id) + ".book";
+    // written under another name, so a half written run is never mistaken for a whole one
+    std::string temporary = run->path + ".tmp";
+    std::FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (file == nullptr) {
+        throw std::runtime_error("Failed to create " + temporary);
+    }
+    {
+        openingBookWriter writer(file, canonicalKeys);
+        fill(writer);
+        if (!writer.finish() || fsync(fileno(file)) != 0) {
+            throw std::runtime_error("Failed to write " + temporary);
+        }
+    }
+    std::filesystem::rename(temporary, run->path);
+    if (!run->book.open(run->path)) {
+        throw std::runtime_error("Failed to open " + run->path);
+    }
+    return run;
+}
+
+void lsmStorage::saveManifest() {
+    std::string path = directory + "/MANIFEST";
+    std::string temporary = path + ".tmp";
+    {
+        std::ofstream manifest(temporary, std::ios::trunc);
+        manifest << "canonical " << canonicalKeys << "\n";
+        manifest << "next " << nextId << "\n";
+        for (const std::shared_ptr<lsmRun>& run : runs) {
+            manifest << "run " << run->id << " " << run->level << "\n";
+        }
+        for (const auto& [name, checkpoint] : checkpoints) {
+            manifest << "checkpoint " << checkpoint.byteOffset << " " << checkpoint.games << " "
+                << checkpoint.postBytes << " " << name << "\n";
+        }
+        for (const std::string& month : appliedMonths) {
+            manifest << "applied " << month << "\n";
+        }
+        if (!manifest.flush()) {
+            throw std::runtime_error("Failed to write " + temporary);
+        }
+    }
+    syncPath(temporary);
+    std::filesystem::rename(temporary, path);
+    // and the rename itself
+    syncPath(directory);
+}
+
+std::vector<std::shared_ptr<lsmRun>> lsmStorage::liveRuns() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return runs;
+}
+
+std::unique_ptr<positionStorage> openLsmStorage(const storageOptions& options) {
+    auto storage = std::make_unique<lsmStorage>(options);
+    try {
+        storage->open();
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return nullptr;
+    }
+    return storage;
+}
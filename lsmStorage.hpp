@@ -0,0 +1,93 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "bookStorage.hpp"
+#include "openingBook.hpp"
+#include "positionStorage.hpp"
+
+// one immutable sorted run. Runs are written in the opening book format, with positions sorted
+// by (key, board, bucket) and moves by (parentKey, move, childKey, bucket), so they merge in
+// one pass
+struct lsmRun {
+    uint64_t id = 0;
+    // 0 for a flush, one more than its inputs for a merge
+    int level = 0;
+    std::string path;
+    openingBook book;
+};
+
+// a log-structured store in a directory of its own, for ingests that outgrow what a B-tree can
+// keep in memory. Every flush is sorted and written out whole as a new run, so the writes stay
+// sequential however big the store gets (the aggregate the parser fills is the memtable).
+// A background thread merges runs of the same level into one, summing the counts they share,
+// so a read only has to look in a few runs. The MANIFEST lists the live runs, the checkpoints
+// and the applied months, and is replaced atomically: after a crash it names either the old
+// runs or the new
+class lsmStorage : public positionStorage {
+ public:
+    explicit lsmStorage(const storageOptions& options);
+    lsmStorage(const lsmStorage&) = delete;
+    lsmStorage& operator=(const lsmStorage&) = delete;
+    ~lsmStorage();
+    // reads the manifest and maps its runs. For an ingest it also deletes the files of runs
+    // that never made it into the manifest, and starts the merging thread
+    void open();
+    void flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint) override;
+    // waits for the merges that are due
+    void finish() override;
+    bool loadCheckpoint(ingestCheckpoint& checkpoint) override;
+    bool getPosition(const positionKey& key, positionStats& stats) override;
+    std::vector<storedMove> getChildren(int64_t parentKey) override;
+    // merges every run into one without the pruned records. Cold records are written to a
+    // cold-<id>.book file next to the runs, which nothing reads
+    pruneResult prune(int minGames, bool keepCold) override;
+    // links the delta into the directory as a new run, and lists the month in the manifest
+    bool applyDelta(const openingBook& delta, const std::string& month) override;
+    // merges every run into one book at path, which has to be on the same filesystem. The
+    // store itself is left as it is. This is how ./parser --delta makes its delta
+    void exportBook(const std::string& path);
+
+ private:
+    void mergeLoop();
+    // one run of the records of inputs whose summed counts pass keep. The ones that don't are
+    // counted in dropped
+    std::shared_ptr<lsmRun> mergeRuns(const std::vector<std::shared_ptr<lsmRun>>& inputs,
+        const std::function<bool(const positionStats&)>& keep, pruneResult& dropped);
+    // swaps inputs for merged in the manifest, and deletes their files. Called with the mutex
+    void replaceRuns(const std::vector<std::shared_ptr<lsmRun>>& inputs,
+        const std::shared_ptr<lsmRun>& merged);
+    // the oldest mergeWidth runs of the lowest level that has that many. Empty if none
+    std::vector<std::shared_ptr<lsmRun>> dueMerge() const;
+    std::shared_ptr<lsmRun> writeRun(int level,
+        const std::function<void(openingBookWriter&)>& fill);
+    // called with the mutex held
+    void saveManifest();
+    std::vector<std::shared_ptr<lsmRun>> liveRuns();
+
+    std::string directory;
+    std::string source;
+    bool ingest;
+    // guards everything below
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::vector<std::shared_ptr<lsmRun>> runs;
+    std::map<std::string, ingestCheckpoint> checkpoints;
+    std::set<std::string> appliedMonths;
+    uint64_t nextId = 0;
+    bool merging = false;
+    bool stopping = false;
+    std::exception_ptr mergeError;
+    std::thread merger;
+};
+
+std::unique_ptr<positionStorage> openLsmStorage(const storageOptions& options);
@@ -1,33 +1,146 @@
 // Copyright Andrew Bernal 2023
-#include <pqxx/pqxx>
 #include <algorithm>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 #include <string>
-#include <sstream>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <fstream>
+#include "gameBucket.hpp"
+#include "moveCode.hpp"
+#include "positionKey.hpp"
+#include "positionStorage.hpp"
 #include "thc.h"
+#include "workStealingPool.hpp"
 
 class chessNode;
+// a move played from a position, with the results of the games that played it
+struct childMove {
+    std::string move;
+    int64_t whiteWins;
+    int64_t blackWins;
+    int64_t draws;
+    int64_t total() const { return whiteWins + blackWins + draws; }
+};
+// how white's move is picked from the candidates
+enum class moveScoring {
+    // white wins over games played
+    winRate,
+    // the points white scores, a draw being half a win
+    score,
+    // the games white doesn't lose
+    notLosing
+};
+// what the builder was told in configuration.txt
+struct builderSettings {
+    // white picks from this many of the most played moves
+    size_t candidateMoves = 3;
+    moveScoring scoring = moveScoring::winRate;
+    // expand the tree a ply at a time with buildTreeByLevel, instead of depth first
+    bool byLevel = false;
+    // depth first only: subtrees are built by this many threads, each with its own storage
+    unsigned int threads = 1;
+};
+// every position expanded so far, so one reached again by another move order is linked to
+// the node that was expanded for it instead of being looked up and built again. Safe to use
+// from many threads
+class transpositionTable {
+ public:
+    // the node already expanded for the position, or null after recording node as it
+    chessNode* claim(const positionStorage& storage, thc::ChessRules& position,
+        chessNode* node);
+
+ private:
+    // the key the storage knows the position by, and the move number. A node is only linked
+    // to one at the same depth, which can't be one of its ancestors
+    struct entry {
+        positionKey key;
+        int fullMoveCount;
+        bool operator==(const entry& other) const {
+            return fullMoveCount == other.fullMoveCount && key == other.key;
+        }
+    };
+    struct entryHash {
+        size_t operator()(const entry& e) const { return e.key.hash ^ e.fullMoveCount; }
+    };
+
+    std::mutex mutex;
+    std::unordered_map<entry, chessNode*, entryHash> nodes;
+};
+// a node whose moves have been looked up, waiting to be expanded
+struct expansionTask {
+    chessNode* node;
+    thc::ChessRules position;
+    bool whiteToMove;
+    std::vector<storedMove> children;
+};
 // builds the tree of chess nodes to put in the PGN file
-void buildTree(pqxx::work& txn, chessNode* node,
-const std::string& FEN, bool whiteToMove, int totalGamesFromStartingPosition);
-// returns the move with the highest win rate from the childrenMoves
-std::string getBestWhiteMove(pqxx::work& txn,
-const std::vector<std::string>& childrenMoves, const std::string& FEN);
+void buildTree(positionStorage& storage, const builderSettings& settings,
+transpositionTable& transpositions, chessNode* node, const std::string& FEN, bool whiteToMove,
+int64_t totalGamesFromStartingPosition);
+// builds the same tree a ply at a time. The positions of a ply are looked up together, so the
+// database's latency is paid per ply instead of per position
+void buildTreeByLevel(positionStorage& storage, const builderSettings& settings,
+    transpositionTable& transpositions, chessNode* root, const std::string& FEN,
+    bool whiteToMove, int64_t totalGamesFromStartingPosition);
+// builds the same tree as buildTree with a thread per storage. Every node is a task on a
+// work stealing pool. A task adds its children to its own node, in order, before pushing
+// them as tasks, so the tree comes out the same however the threads are scheduled
+void buildTreeInParallel(std::vector<std::unique_ptr<positionStorage>>& storages,
+    const builderSettings& settings, transpositionTable& transpositions, chessNode* root,
+    const std::string& FEN, bool whiteToMove, int64_t totalGamesFromStartingPosition);
+// adds the children of task.node and pushes them to the pool, from one lookup of their moves
+void expandTask(positionStorage& storage, const builderSettings& settings,
+    transpositionTable& transpositions, expansionTask& task,
+    int64_t totalGamesFromStartingPosition, workStealingPool<expansionTask>& pool,
+    size_t worker);
+// the moves the tree follows from a position: white's best move, or every black reply that
+// is played often enough
+std::vector<childMove> followedMoves(const std::vector<childMove>& childrenMoves,
+    bool whiteToMove, const builderSettings& settings,
+    int64_t totalGamesFromStartingPosition);
+// the rest of buildTree, once the moves from the position are known
+void expandNode(positionStorage& storage, const builderSettings& settings,
+transpositionTable& transpositions, chessNode* node, const std::string& FEN, bool whiteToMove,
+int64_t totalGamesFromStartingPosition, const std::vector<childMove>& childrenMoves);
+// every move played from the position and its results, from one lookup of its children
+std::vector<childMove> getChildMoves(positionStorage& storage, thc::ChessRules& position);
+// the stored moves of the position as SAN, without the ones that aren't legal in it
+std::vector<childMove> childMovesFrom(thc::ChessRules& position,
+    const std::vector<storedMove>& children);
+// parses winRate, score or notLosing. False for an unknown name
+bool scoringFromName(const std::string& name, moveScoring& scoring);
+// how good the move is for white, between 0 and 1
+double moveScore(const childMove& move, moveScoring scoring);
+// returns the best scoring of the most played childrenMoves. The counts are already in them,
+// so looking at more candidates or scoring them differently costs no lookups
+childMove getBestWhiteMove(const std::vector<childMove>& childrenMoves,
+    const builderSettings& settings);
 void traverseTree(chessNode* root, std::string pgn, std::ofstream& outputFile);
-int getStartingTotalNumGames(pqxx::work& txn, std::string FEN);
+// the nodes of the tree once the transpositions are unrolled, which is how many positions
+// would have been looked up without the transposition table
+size_t unrolledSize(chessNode* node);
+// the nodes whose moves were looked up
+size_t expandedSize(chessNode* node);
+int64_t getStartingTotalNumGames(positionStorage& storage, std::string FEN);
+// writes a whole line to stdout at once, so the lines of buildTreeInParallel's threads don't
+// get mixed up
+void printLine(const std::string& line);
 
 class chessNode {
  public:
-    chessNode(int wInp, int bInp, int dInp, std::string moveInp) {
+    chessNode(int64_t wInp, int64_t bInp, int64_t dInp, std::string moveInp) {
         whiteWin = wInp;
         blackWin = bInp;
         drawn = dInp;
         UCImove = moveInp;
     }
+    // the children of the node it is linked to, if it is a transposition
     chessNode* getChild(int index) {
-        return children[index];
+        return transposition ? transposition->getChild(index) : children[index];
     }
     void addChild(chessNode* toAdd) {
         children.push_back(toAdd);
@@ -36,39 +149,122 @@ class chessNode {
         return UCImove;
     }
     int getNumChildren() {
-        return children.size();
+        return transposition ? transposition->getNumChildren() : children.size();
+    }
+    // the position was expanded under another node. This one shares its children, so the
+    // tree is a DAG until traverseTree writes every path out
+    void linkTo(chessNode* expanded) {
+        transposition = expanded;
+    }
+    bool isTransposition() {
+        return transposition != nullptr;
     }
 
  private:
     std::string UCImove;
-    int whiteWin;
-    int blackWin;
-    int drawn;
+    int64_t whiteWin;
+    int64_t blackWin;
+    int64_t drawn;
     std::vector<chessNode*> children;
+    chessNode* transposition = nullptr;
 };
 
 int main(void) {
     // take configurations from configuration.txt
     std::string FEN;
-    std::string databaseConnectionString;
+    storageOptions options;
+    builderSettings settings;
+    // which games to count. Every rating and speed unless one of these is set
+    int buildMinRating = 0;
+    int buildMaxRating = 4000;
+    std::string buildSpeeds;
     std::ifstream configFile("configuration.txt");
     std::string line;
     while (std::getline(configFile, line)) {
         if (line.find("FEN") != std::string::npos) {
             FEN = line.substr(line.find("=") + 1);
         } else if (line.find("databaseConnectionString") != std::string::npos) {
-            databaseConnectionString = line.substr(line.find("=") + 1);
+            options.databaseConnectionString = line.substr(line.find("=") + 1);
+        } else if (line.find("canonicalPositions") != std::string::npos) {
+            options.canonical = line.substr(line.find("=") + 1) == "true";
+        } else if (line.find("openingBookLocation") != std::string::npos) {
+            options.openingBookLocation = line.substr(line.find("=") + 1);
+        } else if (line.find("sqliteLocation") != std::string::npos) {
+            options.sqliteLocation = line.substr(line.find("=") + 1);
+        } else if (line.find("lsmLocation") != std::string::npos) {
+            options.lsmLocation = line.substr(line.find("=") + 1);
+        } else if (line.find("buildMinRating") != std::string::npos) {
+            buildMinRating = std::stoi(line.substr(line.find("=") + 1));
+        } else if (line.find("buildMaxRating") != std::string::npos) {
+            buildMaxRating = std::stoi(line.substr(line.find("=") + 1));
+        } else if (line.find("buildSpeeds") != std::string::npos) {
+            buildSpeeds = line.substr(line.find("=") + 1);
+        } else if (line.find("candidateMoves") != std::string::npos) {
+            settings.candidateMoves = std::max(1, std::stoi(line.substr(line.find("=") + 1)));
+        } else if (line.find("builderThreads") != std::string::npos) {
+            settings.threads = std::max(1, std::stoi(line.substr(line.find("=") + 1)));
+        } else if (line.find("buildOrder") != std::string::npos) {
+            settings.byLevel = line.substr(line.find("=") + 1) == "levels";
+        } else if (line.find("whiteScoring") != std::string::npos) {
+            if (!scoringFromName(line.substr(line.find("=") + 1), settings.scoring)) {
+                std::cerr << "whiteScoring has to be winRate, score or notLosing" << std::endl;
+                return 1;
+            }
+        } else if (line.find("storage") != std::string::npos) {
+            options.kind = line.substr(line.find("=") + 1);
         }
     }
-    // Connect to the PostgreSQL database
-    pqxx::connection conn(databaseConnectionString);
-    pqxx::work txn(conn);
+    std::vector<gameSpeed> speeds = speedsFromList(buildSpeeds);
+    if (!buildSpeeds.empty() && speeds.empty()) {
+        std::cerr << "buildSpeeds has no known speed in it" << std::endl;
+        return 1;
+    }
+    options.buckets = bucketsFor(buildMinRating, buildMaxRating, speeds);
+    if (options.buckets.size() == bucketCount) {
+        // every bucket, so the reads don't have to filter
+        options.buckets.clear();
+    }
+    // Read the opening book if there is one, so no database has to be running
+    if (!options.openingBookLocation.empty()) {
+        options.kind = "book";
+    }
+    std::unique_ptr<positionStorage> storage = openStorage(options);
+    if (!storage) {
+        return 1;
+    }
 
     bool whiteToMove = false;
     chessNode root(0, 0, 0, "");
 
-    int totalGamesFromStart = getStartingTotalNumGames(txn, FEN);
-    buildTree(txn, &root, FEN, whiteToMove, totalGamesFromStart);
+    int64_t totalGamesFromStart = getStartingTotalNumGames(*storage, FEN);
+    transpositionTable transpositions;
+    if (settings.byLevel) {
+        buildTreeByLevel(*storage, settings, transpositions, &root, FEN, whiteToMove,
+            totalGamesFromStart);
+    } else if (settings.threads > 1) {
+        // a storage per thread. For postgres that is a connection each
+        std::vector<std::unique_ptr<positionStorage>> storages;
+        storages.push_back(std::move(storage));
+        while (storages.size() < settings.threads) {
+            storages.push_back(openStorage(options));
+            if (!storages.back()) {
+                return 1;
+            }
+        }
+        try {
+            buildTreeInParallel(storages, settings, transpositions, &root, FEN, whiteToMove,
+                totalGamesFromStart);
+        } catch (const std::exception& e) {
+            std::cerr << "Building the tree failed: " << e.what() << std::endl;
+            return 1;
+        }
+    } else {
+        buildTree(*storage, settings, transpositions, &root, FEN, whiteToMove,
+            totalGamesFromStart);
+    }
+    size_t expanded = expandedSize(&root);
+    std::cout << "Looked up " << expanded << " positions, "
+        << unrolledSize(&root) - expanded << " more were transpositions\n";
 
     std::ofstream ofs("outputPGN.txt");
     traverseTree(&root, "", ofs);
@@ -77,138 +273,82 @@ int main(void) {
     return 0;
 }
 
-std::string getBestWhiteMove(pqxx::work& txn, const std::vector<std::string>& childrenMoves,
-const std::string& FEN) {
-    std::cout << "Children moves: ";
-    for (const auto& move : childrenMoves) {
-        std::cout << move << '|';
+bool scoringFromName(const std::string& name, moveScoring& scoring) {
+    if (name == "winRate") {
+        scoring = moveScoring::winRate;
+    } else if (name == "score") {
+        scoring = moveScoring::score;
+    } else if (name == "notLosing") {
+        scoring = moveScoring::notLosing;
+    } else {
+        return false;
     }
-    std::cout << '\n';
-    // Select the highest win rate white move from the top 3 most played moves
-    std::vector<std::string> sortedMoves = childrenMoves;
-    std::sort(sortedMoves.begin(), sortedMoves.end(),
-    [&](const std::string& a, const std::string& b) {
-        // Initialize the chessboard with the given FEN
-        thc::ChessRules cr;
-        cr.Forsyth(FEN.c_str());
-
-        // Make move a on the chessboard
-        thc::Move mv;
-        mv.NaturalIn(&cr, a.c_str());
-        cr.PlayMove(mv);
-
-        // Generate the updated FEN for move a
-        std::string updatedFenA = cr.ForsythPublish();
-
-        // Query the database for data for move a
-        pqxx::result aResult = txn.exec_params(
-            "SELECT white_wins, black_wins, draws FROM lichess WHERE fen = $1",
-            updatedFenA);
-
-        // Reset the chessboard to the original FEN
-        cr.Forsyth(FEN.c_str());
-
-        // Make move b on the chessboard
-        mv.NaturalIn(&cr, b.c_str());
-        cr.PlayMove(mv);
-
-        // Generate the updated FEN for move b
-        std::string updatedFenB = cr.ForsythPublish();
-
-        // Query the database for data for move b
-        pqxx::result bResult = txn.exec_params(
-            "SELECT white_wins, black_wins, draws FROM lichess WHERE fen = $1",
-            updatedFenB);
+    return true;
+}
 
-        int aTotal = aResult[0][0].as<int>() + aResult[0][1].as<int>() +
-                    aResult[0][2].as<int>();
-        int bTotal = bResult[0][0].as<int>() + bResult[0][1].as<int>() +
-                    bResult[0][2].as<int>();
+double moveScore(const childMove& move, moveScoring scoring) {
+    if (move.total() == 0) {
+        return 0;
+    }
+    double points = move.whiteWins;
+    if (scoring == moveScoring::score) {
+        points += 0.5 * move.draws;
+    } else if (scoring == moveScoring::notLosing) {
+        points += move.draws;
+    }
+    return points / move.total();
+}
 
-        return aTotal > bTotal;
+childMove getBestWhiteMove(const std::vector<childMove>& childrenMoves,
+    const builderSettings& settings) {
+    std::string line = "Children moves: ";
+    for (const auto& move : childrenMoves) {
+        line += move.move + '|';
+    }
+    printLine(line);
+    // Select the best scoring white move from the most played moves. Only the candidates
+    // have to be in order
+    std::vector<childMove> sortedMoves = childrenMoves;
+    size_t candidates = std::min(settings.candidateMoves, sortedMoves.size());
+    std::partial_sort(sortedMoves.begin(), sortedMoves.begin() + candidates, sortedMoves.end(),
+    [&](const childMove& a, const childMove& b) {
+        return a.total() > b.total();
     });
-    sortedMoves.resize(std::min<size_t>(3, sortedMoves.size()));
+    sortedMoves.resize(candidates);
 
     auto it = std::max_element(sortedMoves.begin(), sortedMoves.end(),
-    [&](const std::string& a, const std::string& b) {
-        // Initialize the chessboard with the given FEN
-        thc::ChessRules cr;
-        cr.Forsyth(FEN.c_str());
-
-        // Make move a on the chessboard
-        thc::Move mv;
-        mv.NaturalIn(&cr, a.c_str());
-        cr.PlayMove(mv);
-
-        // Generate the updated FEN for move a
-        std::string updatedFenA = cr.ForsythPublish();
-
-        // Query the database for data for move a
-        pqxx::result aResult = txn.exec_params(
-            "SELECT white_wins, black_wins, draws FROM lichess WHERE fen = $1",
-            updatedFenA);
-
-        // Reset the chessboard to the original FEN
-        cr.Forsyth(FEN.c_str());
-
-        // Make move b on the chessboard
-        mv.NaturalIn(&cr, b.c_str());
-        cr.PlayMove(mv);
-
-        // Generate the updated FEN for move b
-        std::string updatedFenB = cr.ForsythPublish();
-
-        // Query the database for data for move b
-        pqxx::result bResult = txn.exec_params(
-            "SELECT white_wins, black_wins, draws FROM lichess WHERE fen = $1",
-            updatedFenB);
-
-        int aTotal = aResult[0][0].as<int>() + aResult[0][1].as<int>() +
-                    aResult[0][2].as<int>();
-        int bTotal = bResult[0][0].as<int>() + bResult[0][1].as<int>() +
-                    bResult[0][2].as<int>();
-
-        double aWinRate =
-            aTotal == 0 ? 0 : static_cast<double>(aResult[0][0].as<int>()) / aTotal;
-
-        double bWinRate =
-            bTotal == 0 ? 0 : static_cast<double>(bResult[0][0].as<int>()) / bTotal;
-
-        return aWinRate < bWinRate;
+    [&](const childMove& a, const childMove& b) {
+        return moveScore(a, settings.scoring) < moveScore(b, settings.scoring);
     });
     return *it;
 }
 
-void buildTree(pqxx::work& txn, chessNode* node, const std::string& FEN,
-bool whiteToMove, int totalGamesFromStartingPosition) {
-    // Query the database for data for the given FEN
-    pqxx::result result = txn.exec_params("SELECT white_wins, black_wins, draws, "
-    "children_moves FROM lichess WHERE fen = $1", FEN);
+void buildTree(positionStorage& storage, const builderSettings& settings,
+transpositionTable& transpositions, chessNode* node, const std::string& FEN, bool whiteToMove,
+int64_t totalGamesFromStartingPosition) {
+    // Query the database for the moves from the given FEN, with their results
+    thc::ChessRules position;
+    position.Forsyth(FEN.c_str());
+    std::vector<childMove> childrenMoves = getChildMoves(storage, position);
+    expandNode(storage, settings, transpositions, node, FEN, whiteToMove,
+        totalGamesFromStartingPosition, childrenMoves);
+}
 
-    // Check if a row was returned
-    if (result.size() == 0) {
+void expandNode(positionStorage& storage, const builderSettings& settings,
+transpositionTable& transpositions, chessNode* node, const std::string& FEN, bool whiteToMove,
+int64_t totalGamesFromStartingPosition, const std::vector<childMove>& childrenMoves) {
+    // Check if a move was returned
+    if (childrenMoves.size() == 0) {
         // No data was found for the given FEN
         return;
     }
 
-    // Get the data from the result
-    int whiteWins = result[0][0].as<int>();
-    int blackWins = result[0][1].as<int>();
-    int draws = result[0][2].as<int>();
-    // Manually parse the children_moves array
-    std::string childrenMovesStr = result[0][3].as<std::string>();
-    std::vector<std::string> childrenMoves;
-    std::stringstream ss(childrenMovesStr.substr(1, childrenMovesStr.size() - 2));
-    std::string tempMove;
-    while (std::getline(ss, tempMove, ',')) {
-        childrenMoves.push_back(tempMove);
-    }
-
-    if (whiteToMove && childrenMoves.size() > 0) {
-        const std::string& move = getBestWhiteMove(txn, childrenMoves, FEN);
-        std::cout << move << "\n";
+    std::vector<childMove> followed = followedMoves(childrenMoves, whiteToMove, settings,
+        totalGamesFromStartingPosition);
+    if (whiteToMove) {
+        const childMove best = followed[0];
 
-        chessNode* child = new chessNode(whiteWins, blackWins, draws, move);
+        chessNode* child = new chessNode(best.whiteWins, best.blackWins, best.draws, best.move);
         node->addChild(child);
 
         // Initialize the chessboard with the given FEN
@@ -217,64 +357,264 @@ bool whiteToMove, int totalGamesFromStartingPosition) {
 
         // Make the move on the chessboard
         thc::Move mv;
-        mv.NaturalIn(&cr, move.c_str());
+        mv.NaturalIn(&cr, best.move.c_str());
         cr.PlayMove(mv);
 
+        // The position may already have been built by another move order
+        if (chessNode* expanded = transpositions.claim(storage, cr, child)) {
+            child->linkTo(expanded);
+            return;
+        }
+
         // Generate the updated FEN
         std::string updatedFen = cr.ForsythPublish();
 
-        buildTree(txn, child, updatedFen, !whiteToMove, totalGamesFromStartingPosition);
+        buildTree(storage, settings, transpositions, child, updatedFen, !whiteToMove,
+            totalGamesFromStartingPosition);
     } else {
-        // all of the black moves with 1/1000 frequency of being played in the starting position
-        for (const auto& move : childrenMoves) {
-            // Generate the updated FEN
+        // The moves from all of the replies are looked up together, in one round trip
+        std::vector<chessNode*> children;
+        std::vector<thc::ChessRules> positions;
+        std::vector<int64_t> keys;
+        for (const childMove& move : followed) {
+            chessNode* child = new chessNode(move.whiteWins, move.blackWins, move.draws,
+                move.move);
+            node->addChild(child);
+
+            // Play the reply
             thc::ChessRules cr;
             cr.Forsyth(FEN.c_str());
             thc::Move mv;
-            mv.NaturalIn(&cr, move.c_str());
+            mv.NaturalIn(&cr, move.move.c_str());
             cr.PlayMove(mv);
-            std::string updatedFen = cr.ForsythPublish();
+            if (chessNode* expanded = transpositions.claim(storage, cr, child)) {
+                child->linkTo(expanded);
+                continue;
+            }
 
-            pqxx::result moveResult = txn.exec_params(
-                "SELECT white_wins, black_wins, draws FROM lichess WHERE fen = $1", updatedFen);
+            children.push_back(child);
+            positions.push_back(cr);
+            keys.push_back(databaseKey(makePositionKey(cr, storage.canonical())));
+        }
+        std::vector<std::vector<storedMove>> childLists = storage.getChildLists(keys);
+        for (size_t i = 0; i < children.size(); i++) {
+            std::string updatedFen = positions[i].ForsythPublish();
+            expandNode(storage, settings, transpositions, children[i], updatedFen,
+                !whiteToMove, totalGamesFromStartingPosition,
+                childMovesFrom(positions[i], childLists[i]));
+        }
+    }
+}
 
-            int whiteWins = moveResult[0][0].as<int>();
-            int blackWins = moveResult[0][1].as<int>();
-            int draws = moveResult[0][2].as<int>();
-            int totalChildGames = whiteWins + blackWins + draws;
+std::vector<childMove> followedMoves(const std::vector<childMove>& childrenMoves,
+    bool whiteToMove, const builderSettings& settings,
+    int64_t totalGamesFromStartingPosition) {
+    if (childrenMoves.empty()) {
+        return {};
+    }
+    if (whiteToMove) {
+        childMove best = getBestWhiteMove(childrenMoves, settings);
+        printLine(best.move);
+        return {best};
+    }
+    // all of the black moves with 1/1000 frequency of being played in the starting position
+    std::vector<childMove> followed;
+    for (const childMove& move : childrenMoves) {
+        int64_t totalChildGames = move.total();
+
+        double probability = static_cast<double>(totalChildGames) /
+            totalGamesFromStartingPosition;
+
+        // 1/200 = 0.005, which is greater than 0.001.
+        // If there were only 200 games from a positon, the probability will never be 0.01
+        if (probability > 0.001 && totalChildGames > 5) {
+            followed.push_back(move);
+        }
+    }
+    return followed;
+}
 
-            double probability = static_cast<double>(totalChildGames) /
-                totalGamesFromStartingPosition;
+void buildTreeByLevel(positionStorage& storage, const builderSettings& settings,
+    transpositionTable& transpositions, chessNode* root, const std::string& FEN,
+    bool whiteToMove, int64_t totalGamesFromStartingPosition) {
+    // a position of the current ply, and the node its moves are added to
+    struct frontierNode {
+        chessNode* node;
+        thc::ChessRules position;
+        bool whiteToMove;
+    };
+    std::vector<frontierNode> frontier(1);
+    frontier[0].node = root;
+    frontier[0].position.Forsyth(FEN.c_str());
+    frontier[0].whiteToMove = whiteToMove;
+    // a wide ply is looked up in a few big batches rather than one huge one
+    const size_t batchSize = 1024;
+    for (int ply = 0; !frontier.empty(); ply++) {
+        std::cout << "Ply " << ply << ": " << frontier.size() << " positions\n";
+        std::vector<int64_t> keys;
+        for (frontierNode& entry : frontier) {
+            keys.push_back(databaseKey(makePositionKey(entry.position, storage.canonical())));
+        }
+        std::vector<std::vector<storedMove>> childLists;
+        for (size_t first = 0; first < keys.size(); first += batchSize) {
+            std::vector<int64_t> batch(keys.begin() + first,
+                keys.begin() + std::min(keys.size(), first + batchSize));
+            for (std::vector<storedMove>& children : storage.getChildLists(batch)) {
+                childLists.push_back(std::move(children));
+            }
+        }
 
-            // 1/200 = 0.005, which is greater than 0.001.
-            // If there were only 200 games from a positon, the probability will never be 0.01
-            if (probability > 0.001 && totalChildGames > 5) {
-                chessNode* child = new chessNode(whiteWins, blackWins, draws, move);
-                node->addChild(child);
+        // the next ply, in the order the nodes are added, so the tree is the same as
+        // buildTree's
+        std::vector<frontierNode> next;
+        for (size_t i = 0; i < frontier.size(); i++) {
+            frontierNode& entry = frontier[i];
+            std::vector<childMove> childrenMoves = childMovesFrom(entry.position, childLists[i]);
+            for (const childMove& move : followedMoves(childrenMoves, entry.whiteToMove,
+                settings, totalGamesFromStartingPosition)) {
+                chessNode* child = new chessNode(move.whiteWins, move.blackWins, move.draws,
+                    move.move);
+                entry.node->addChild(child);
+
+                frontierNode reply = {child, entry.position, !entry.whiteToMove};
+                thc::Move mv;
+                mv.NaturalIn(&reply.position, move.move.c_str());
+                reply.position.PlayMove(mv);
+                if (chessNode* expanded = transpositions.claim(storage, reply.position, child)) {
+                    child->linkTo(expanded);
+                    continue;
+                }
+                next.push_back(reply);
+            }
+        }
+        frontier = std::move(next);
+    }
+}
 
-                buildTree(txn, child, updatedFen, !whiteToMove,
-                    totalGamesFromStartingPosition);
+void buildTreeInParallel(std::vector<std::unique_ptr<positionStorage>>& storages,
+    const builderSettings& settings, transpositionTable& transpositions, chessNode* root,
+    const std::string& FEN, bool whiteToMove, int64_t totalGamesFromStartingPosition) {
+    workStealingPool<expansionTask> pool(storages.size());
+    expansionTask first = {root, thc::ChessRules(), whiteToMove, {}};
+    first.position.Forsyth(FEN.c_str());
+    positionKey key = makePositionKey(first.position, storages[0]->canonical());
+    first.children = storages[0]->getChildren(databaseKey(key));
+    pool.push(0, std::move(first));
+
+    // the first error stops the build, the other workers drain the pool without expanding
+    std::mutex errorMutex;
+    std::string error;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < storages.size(); i++) {
+        workers.emplace_back([&, i] {
+            expansionTask task;
+            while (pool.pop(i, task)) {
+                bool failed;
+                {
+                    std::lock_guard<std::mutex> lock(errorMutex);
+                    failed = !error.empty();
+                }
+                if (!failed) {
+                    try {
+                        expandTask(*storages[i], settings, transpositions, task,
+                            totalGamesFromStartingPosition, pool, i);
+                    } catch (const std::exception& e) {
+                        std::lock_guard<std::mutex> lock(errorMutex);
+                        if (error.empty()) {
+                            error = e.what();
+                        }
+                    }
+                }
+                pool.done();
             }
+        });
+    }
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (!error.empty()) {
+        throw std::runtime_error(error);
+    }
+}
+
+void expandTask(positionStorage& storage, const builderSettings& settings,
+    transpositionTable& transpositions, expansionTask& task,
+    int64_t totalGamesFromStartingPosition, workStealingPool<expansionTask>& pool,
+    size_t worker) {
+    std::vector<childMove> childrenMoves = childMovesFrom(task.position, task.children);
+    std::vector<expansionTask> children;
+    std::vector<int64_t> keys;
+    for (const childMove& move : followedMoves(childrenMoves, task.whiteToMove, settings,
+        totalGamesFromStartingPosition)) {
+        chessNode* child = new chessNode(move.whiteWins, move.blackWins, move.draws,
+            move.move);
+        task.node->addChild(child);
+
+        expansionTask next = {child, task.position, !task.whiteToMove, {}};
+        thc::Move mv;
+        mv.NaturalIn(&next.position, move.move.c_str());
+        next.position.PlayMove(mv);
+        if (chessNode* expanded = transpositions.claim(storage, next.position, child)) {
+            child->linkTo(expanded);
+            continue;
         }
+        keys.push_back(databaseKey(makePositionKey(next.position, storage.canonical())));
+        children.push_back(std::move(next));
+    }
+    if (children.empty()) {
+        return;
+    }
+    // the moves of all of the children are looked up together, like in expandNode
+    std::vector<std::vector<storedMove>> childLists = storage.getChildLists(keys);
+    for (size_t i = 0; i < children.size(); i++) {
+        children[i].children = std::move(childLists[i]);
+        pool.push(worker, std::move(children[i]));
     }
 }
 
-int getStartingTotalNumGames(pqxx::work& txn, std::string FEN) {
-    // Query the database for data for the given FEN
-    pqxx::result result = txn.exec_params(
-        "SELECT white_wins, black_wins, draws FROM lichess WHERE fen = $1", FEN);
+chessNode* transpositionTable::claim(const positionStorage& storage,
+    thc::ChessRules& position, chessNode* node) {
+    entry key = {makePositionKey(position, storage.canonical()), position.full_move_count};
+    std::lock_guard<std::mutex> lock(mutex);
+    auto [it, added] = nodes.emplace(key, node);
+    return added ? nullptr : it->second;
+}
+
+std::vector<childMove> getChildMoves(positionStorage& storage, thc::ChessRules& position) {
+    positionKey key = makePositionKey(position, storage.canonical());
+    return childMovesFrom(position, storage.getChildren(databaseKey(key)));
+}
+
+std::vector<childMove> childMovesFrom(thc::ChessRules& position,
+    const std::vector<storedMove>& children) {
+    std::vector<moveCode> codes;
+    for (const storedMove& child : children) {
+        codes.push_back(child.move);
+    }
+    std::vector<std::string> sans = movesSan(position, codes);
 
-    // Check if a row was returned
-    if (result.size() == 0) {
+    std::vector<childMove> childrenMoves;
+    for (size_t i = 0; i < codes.size(); i++) {
+        // a move that isn't legal here belongs to another position with the same key
+        if (sans[i].empty()) {
+            continue;
+        }
+        const positionStats& stats = children[i].stats;
+        childrenMoves.push_back({sans[i], stats.whiteWins, stats.blackWins, stats.draws});
+    }
+    return childrenMoves;
+}
+
+int64_t getStartingTotalNumGames(positionStorage& storage, std::string FEN) {
+    // Query the database for data for the given FEN
+    thc::ChessRules position;
+    position.Forsyth(FEN.c_str());
+    positionStats stats;
+    if (!storage.getPosition(makePositionKey(position, storage.canonical()), stats)) {
         // No data was found for the given FEN
         return 1;
     }
-
-    // Get the data from the result
-    int whiteWins = result[0][0].as<int>();
-    int blackWins = result[0][1].as<int>();
-    int draws = result[0][2].as<int>();
-    int totalGamesFromStartingPosition = whiteWins + blackWins + draws;
+    int64_t totalGamesFromStartingPosition = stats.whiteWins + stats.blackWins + stats.draws;
     return totalGamesFromStartingPosition;
 }
 
@@ -290,3 +630,28 @@ void traverseTree(chessNode* root, std::string pgn, std::ofstream& outputFile) {
     }
 }
 
+size_t unrolledSize(chessNode* node) {
+    size_t size = 1;
+    for (int i = 0; i < node->getNumChildren(); i++) {
+        size += unrolledSize(node->getChild(i));
+    }
+    return size;
+}
+
+size_t expandedSize(chessNode* node) {
+    // a transposition's children belong to the node it is linked to
+    if (node->isTransposition()) {
+        return 0;
+    }
+    size_t size = 1;
+    for (int i = 0; i < node->getNumChildren(); i++) {
+        size += expandedSize(node->getChild(i));
+    }
+    return size;
+}
+
+void printLine(const std::string& line) {
+    static std::mutex outputMutex;
+    std::lock_guard<std::mutex> lock(outputMutex);
+    std::cout << line << '\n';
+}
@@ -0,0 +1,133 @@
+// Copyright Andrew Bernal 2023
+#include "memoryStorage.hpp"
+#include <algorithm>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+void addStats(positionStats& into, const positionStats& from) {
+    into.whiteWins += from.whiteWins;
+    into.blackWins += from.blackWins;
+    into.draws += from.draws;
+}
+}  // namespace
+
+void memoryStorage::flush(const positionAggregate& aggregate,
+    const ingestCheckpoint& checkpoint) {
+    for (const auto& [position, stats] : aggregate.positions) {
+        auto& buckets = positions[position.key];
+        auto it = std::find_if(buckets.begin(), buckets.end(), [&](const auto& bucket) {
+            return bucket.first == position.bucket;
+        });
+        if (it == buckets.end()) {
+            buckets.push_back({position.bucket, stats});
+        } else {
+            addStats(it->second, stats);
+        }
+    }
+    for (const auto& [edge, stats] : aggregate.moves) {
+        std::vector<bucketMove>& moves = children[edge.parentKey];
+        // a position only has a handful of different moves, a linear search is fine
+        auto it = std::find_if(moves.begin(), moves.end(), [&](const bucketMove& move) {
+            return move.move == edge.move && move.childKey == edge.childKey &&
+                move.bucket == edge.bucket;
+        });
+        if (it == moves.end()) {
+            moves.push_back({edge.move, edge.childKey, edge.bucket, stats});
+        } else {
+            addStats(it->stats, stats);
+        }
+    }
+    lastCheckpoint = checkpoint;
+    flushed = true;
+}
+
+bool memoryStorage::loadCheckpoint(ingestCheckpoint& checkpoint) {
+    checkpoint = lastCheckpoint;
+    return flushed;
+}
+
+bool memoryStorage::getPosition(const positionKey& key, positionStats& stats) {
+    auto it = positions.find(key);
+    if (it == positions.end()) {
+        return false;
+    }
+    stats = positionStats();
+    bool found = false;
+    for (const auto& [bucket, bucketStats] : it->second) {
+        if (wanted(bucket)) {
+            addStats(stats, bucketStats);
+            found = true;
+        }
+    }
+    return found;
+}
+
+std::vector<storedMove> memoryStorage::getChildren(int64_t parentKey) {
+    std::vector<storedMove> summed;
+    auto it = children.find(parentKey);
+    if (it == children.end()) {
+        return summed;
+    }
+    for (const bucketMove& move : it->second) {
+        if (!wanted(move.bucket)) {
+            continue;
+        }
+        auto same = std::find_if(summed.begin(), summed.end(), [&](const storedMove& child) {
+            return child.move == move.move && child.childKey == move.childKey;
+        });
+        if (same == summed.end()) {
+            summed.push_back({move.move, move.childKey, move.stats});
+        } else {
+            addStats(same->stats, move.stats);
+        }
+    }
+    return summed;
+}
+
+pruneResult memoryStorage::prune(int minGames, bool) {
+    pruneResult pruned;
+    for (auto it = positions.begin(); it != positions.end();) {
+        int64_t total = 0;
+        for (const auto& bucket : it->second) {
+            total += bucket.second.total();
+        }
+        if (total < minGames) {
+            pruned.positions += it->second.size();
+            it = positions.erase(it);
+        } else {
+            it++;
+        }
+    }
+    for (auto it = children.begin(); it != children.end();) {
+        std::vector<bucketMove>& moves = it->second;
+        // a move's total is over every bucket it was played in
+        auto total = [&](const bucketMove& move) {
+            int64_t games = 0;
+            for (const bucketMove& other : moves) {
+                if (other.move == move.move && other.childKey == move.childKey) {
+                    games += other.stats.total();
+                }
+            }
+            return games;
+        };
+        std::vector<bucketMove> kept;
+        for (const bucketMove& move : moves) {
+            if (total(move) >= minGames) {
+                kept.push_back(move);
+            }
+        }
+        pruned.moves += moves.size() - kept.size();
+        moves = std::move(kept);
+        it = moves.empty() ? children.erase(it) : std::next(it);
+    }
+    return pruned;
+}
+
+bool memoryStorage::applyDelta(const openingBook&, const std::string&) {
+    throw std::logic_error("the memory storage is empty at every start, apply the month to one "
+        "that is kept");
+}
@@ -0,0 +1,39 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <cstdint>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "positionStorage.hpp"
+
+// keeps everything in hash tables and forgets it at exit. For testing and benchmarking both
+// programs without a database, and for ingests small enough to be looked at straight away
+class memoryStorage : public positionStorage {
+ public:
+    memoryStorage(bool canonicalInp, const std::vector<gameBucket>& bucketsInp)
+        : positionStorage(canonicalInp, bucketsInp) {}
+    void flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint) override;
+    bool loadCheckpoint(ingestCheckpoint& checkpoint) override;
+    bool getPosition(const positionKey& key, positionStats& stats) override;
+    std::vector<storedMove> getChildren(int64_t parentKey) override;
+    // there is nowhere to keep cold rows, they are always deleted
+    pruneResult prune(int minGames, bool keepCold) override;
+    // an error. Nothing is kept between runs, so there is nothing to add a month to
+    bool applyDelta(const openingBook& delta, const std::string& month) override;
+
+ private:
+    // a move's games in one bucket
+    struct bucketMove {
+        moveCode move;
+        int64_t childKey;
+        gameBucket bucket;
+        positionStats stats;
+    };
+
+    // a position is only played in a few buckets, so they are a short list
+    std::unordered_map<positionKey, std::vector<std::pair<gameBucket, positionStats>>,
+        positionKeyHash> positions;
+    std::unordered_map<int64_t, std::vector<bucketMove>> children;
+    ingestCheckpoint lastCheckpoint;
+    bool flushed = false;
+};
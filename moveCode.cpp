@@ -0,0 +1,43 @@
+// Copyright Andrew Bernal 2023
+#include "moveCode.hpp"
+#include <string>
+#include <vector>
+
+moveCode encodeMove(const thc::Move& move) {
+    int promotion = 0;
+    switch (move.special) {
+        case thc::SPECIAL_PROMOTION_ROOK:
+            promotion = 1;
+            break;
+        case thc::SPECIAL_PROMOTION_BISHOP:
+            promotion = 2;
+            break;
+        case thc::SPECIAL_PROMOTION_KNIGHT:
+            promotion = 3;
+            break;
+        default:
+            break;
+    }
+    return static_cast<moveCode>(move.src | (move.dst << 6) | (promotion << 12));
+}
+
+std::vector<std::string> movesSan(thc::ChessRules& position, const std::vector<moveCode>& codes) {
+    std::vector<thc::Move> legalMoves;
+    position.GenLegalMoveList(legalMoves);
+    std::vector<std::string> sans;
+    for (moveCode code : codes) {
+        std::string san;
+        for (thc::Move& move : legalMoves) {
+            if (encodeMove(move) == code) {
+                san = move.NaturalOut(&position);
+                // the database stores moves the way they are typed, without + or #
+                while (!san.empty() && (san.back() == '+' || san.back() == '#')) {
+                    san.pop_back();
+                }
+                break;
+            }
+        }
+        sans.push_back(san);
+    }
+    return sans;
+}
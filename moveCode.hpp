@@ -0,0 +1,17 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "thc.h"
+
+// a move in 16 bits: bits 0-5 are the from square, 6-11 the to square (thc's a8=0 numbering),
+// and 12-13 the promotion piece (queen, rook, bishop, knight). 0 is never a legal move,
+// it stands for "no move" after the last position of a game
+using moveCode = uint16_t;
+constexpr moveCode noMove = 0;
+
+moveCode encodeMove(const thc::Move& move);
+
+// the SAN of each code, without check or mate marks, "" for codes that aren't legal here
+std::vector<std::string> movesSan(thc::ChessRules& position, const std::vector<moveCode>& codes);
@@ -0,0 +1,163 @@
+// Copyright Andrew Bernal 2023
+#include "openingBook.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+namespace {
+uint64_t fenceCount(uint64_t records, uint32_t stride) {
+    return (records + stride - 1) / stride;
+}
+
+// the first record whose key is at least key. fences[i] is the key of records[i * stride], so
+// the answer is in the block before the first fence that is at least key (or at its start)
+template <typename Record>
+const Record* lowerBound(const Record* records, uint64_t count, const int64_t* fences,
+    uint64_t fenceTotal, uint32_t stride, int64_t Record::*keyField, int64_t key) {
+    uint64_t fence = std::lower_bound(fences, fences + fenceTotal, key) - fences;
+    uint64_t from = fence == 0 ? 0 : (fence - 1) * stride;
+    uint64_t to = std::min(count, fence * stride + 1);
+    return std::lower_bound(records + from, records + to, key,
+        [&](const Record& record, int64_t value) { return record.*keyField < value; });
+}
+}  // namespace
+
+openingBookWriter::openingBookWriter(std::FILE* fileInp, bool canonical, uint32_t fenceStrideInp)
+    : file(fileInp) {
+    std::memcpy(header.magic, bookMagic, sizeof(bookMagic));
+    header.flags = canonical ? bookCanonical : 0;
+    header.fenceStride = fenceStrideInp;
+    header.positionCount = 0;
+    header.moveCount = 0;
+    // the real header is written by finish, once the counts are known
+    failed = std::fwrite(&header, sizeof(header), 1, file) != 1;
+}
+
+openingBookWriter::~openingBookWriter() {
+    std::fclose(file);
+}
+
+void openingBookWriter::addPosition(int64_t key, const uint8_t* board, gameBucket bucket,
+    const positionStats& stats) {
+    if (header.positionCount % header.fenceStride == 0) {
+        positionFences.push_back(key);
+    }
+    bookPosition position = {};
+    position.key = key;
+    std::memcpy(position.board, board, sizeof(position.board));
+    position.whiteWins = stats.whiteWins;
+    position.blackWins = stats.blackWins;
+    position.draws = stats.draws;
+    position.bucket = bucket;
+    failed |= std::fwrite(&position, sizeof(position), 1, file) != 1;
+    header.positionCount++;
+}
+
+void openingBookWriter::addMove(int64_t parentKey, moveCode move, int64_t childKey,
+    gameBucket bucket, const positionStats& stats) {
+    if (header.moveCount % header.fenceStride == 0) {
+        moveFences.push_back(parentKey);
+    }
+    bookMove edge = {};
+    edge.parentKey = parentKey;
+    edge.childKey = childKey;
+    edge.whiteWins = stats.whiteWins;
+    edge.blackWins = stats.blackWins;
+    edge.draws = stats.draws;
+    edge.move = move;
+    edge.bucket = bucket;
+    failed |= std::fwrite(&edge, sizeof(edge), 1, file) != 1;
+    header.moveCount++;
+}
+
+bool openingBookWriter::finish() {
+    failed |= std::fwrite(positionFences.data(), sizeof(int64_t), positionFences.size(), file) !=
+        positionFences.size();
+    failed |= std::fwrite(moveFences.data(), sizeof(int64_t), moveFences.size(), file) !=
+        moveFences.size();
+    failed |= std::fseek(file, 0, SEEK_SET) != 0;
+    failed |= std::fwrite(&header, sizeof(header), 1, file) != 1;
+    failed |= std::fflush(file) != 0;
+    return !failed;
+}
+
+openingBook::~openingBook() {
+    if (map != nullptr) {
+        munmap(const_cast<char*>(map), mapSize);
+    }
+}
+
+bool openingBook::open(const std::string& path) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(bookHeader)) {
+        close(fd);
+        return false;
+    }
+    void* mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+    map = static_cast<const char*>(mapped);
+    mapSize = st.st_size;
+    filePath = path;
+    // lookups jump around the file
+    madvise(mapped, mapSize, MADV_RANDOM);
+
+    header = reinterpret_cast<const bookHeader*>(map);
+    if (std::memcmp(header->magic, bookMagic, sizeof(bookMagic)) != 0 ||
+        header->fenceStride == 0) {
+        return false;
+    }
+    positionFenceCount = fenceCount(header->positionCount, header->fenceStride);
+    moveFenceCount = fenceCount(header->moveCount, header->fenceStride);
+    size_t expected = sizeof(bookHeader) + header->positionCount * sizeof(bookPosition) +
+        header->moveCount * sizeof(bookMove) + (positionFenceCount + moveFenceCount) *
+        sizeof(int64_t);
+    if (mapSize != expected) {
+        return false;
+    }
+    positions = reinterpret_cast<const bookPosition*>(map + sizeof(bookHeader));
+    moves = reinterpret_cast<const bookMove*>(positions + header->positionCount);
+    positionFences = reinterpret_cast<const int64_t*>(moves + header->moveCount);
+    moveFences = positionFences + positionFenceCount;
+    return true;
+}
+
+bookPositionRange openingBook::findPosition(const positionKey& key) const {
+    int64_t wanted = databaseKey(key);
+    const bookPosition* end = positions + header->positionCount;
+    // positions that share a key are next to each other, the board tells them apart,
+    // and the buckets of a board are next to each other too
+    const bookPosition* first = lowerBound(positions, header->positionCount, positionFences,
+        positionFenceCount, header->fenceStride, &bookPosition::key, wanted);
+    while (first != end && first->key == wanted &&
+        std::memcmp(first->board, key.board.storage, sizeof(first->board)) != 0) {
+        first++;
+    }
+    const bookPosition* last = first;
+    while (last != end && last->key == wanted &&
+        std::memcmp(last->board, key.board.storage, sizeof(last->board)) == 0) {
+        last++;
+    }
+    return {first, last};
+}
+
+bookMoveRange openingBook::findMoves(int64_t parentKey) const {
+    const bookMove* end = moves + header->moveCount;
+    const bookMove* first = lowerBound(moves, header->moveCount, moveFences, moveFenceCount,
+        header->fenceStride, &bookMove::parentKey, parentKey);
+    const bookMove* last = first;
+    while (last != end && last->parentKey == parentKey) {
+        last++;
+    }
+    return {first, last};
+}
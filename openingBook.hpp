@@ -0,0 +1,127 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "moveCode.hpp"
+#include "positionAggregate.hpp"
+#include "positionKey.hpp"
+
+// The opening book is the lichess and lichess_moves tables in one read-only file, so the
+// repertoireBuilder can run without postgres. It is:
+//   bookHeader
+//   bookPosition[positionCount], sorted by key, then board, then bucket
+//   bookMove[moveCount], sorted by parentKey
+//   int64_t positionFences[], the key of every fenceStride-th position
+//   int64_t moveFences[], the parentKey of every fenceStride-th move
+// The fences are small enough to stay in the cache. A lookup binary searches them, then
+// searches the one block of records they point to
+struct bookHeader {
+    char magic[8];
+    // bookCanonical if the keys were made with canonicalPositions
+    uint32_t flags;
+    uint32_t fenceStride;
+    uint64_t positionCount;
+    uint64_t moveCount;
+};
+
+// the counts are 64-bit, like the columns they come from
+struct bookPosition {
+    int64_t key;
+    uint8_t board[24];
+    int64_t whiteWins;
+    int64_t blackWins;
+    int64_t draws;
+    uint16_t bucket;
+    uint16_t unused[3];
+};
+
+struct bookMove {
+    int64_t parentKey;
+    int64_t childKey;
+    int64_t whiteWins;
+    int64_t blackWins;
+    int64_t draws;
+    moveCode move;
+    uint16_t bucket;
+    uint32_t unused;
+};
+
+static_assert(sizeof(bookHeader) == 32, "the book header is written as is");
+static_assert(sizeof(bookPosition) == 64, "book positions are written as is");
+static_assert(sizeof(bookMove) == 48, "book moves are written as is");
+
+constexpr char bookMagic[8] = {'R', 'B', 'B', 'O', 'O', 'K', '2', '\n'};
+constexpr uint32_t bookCanonical = 1;
+
+// writes a book front to back. Every position has to be added before the first move,
+// and both in key order
+class openingBookWriter {
+ public:
+    openingBookWriter(std::FILE* fileInp, bool canonical, uint32_t fenceStrideInp = 256);
+    ~openingBookWriter();
+    void addPosition(int64_t key, const uint8_t* board, gameBucket bucket,
+        const positionStats& stats);
+    void addMove(int64_t parentKey, moveCode move, int64_t childKey, gameBucket bucket,
+        const positionStats& stats);
+    // writes the fences and the header. False if anything failed to write
+    bool finish();
+
+ private:
+    std::FILE* file;
+    bookHeader header;
+    std::vector<int64_t> positionFences;
+    std::vector<int64_t> moveFences;
+    bool failed = false;
+};
+
+// the buckets of one position, pointing into the mapped file
+struct bookPositionRange {
+    const bookPosition* first;
+    const bookPosition* last;
+    const bookPosition* begin() const { return first; }
+    const bookPosition* end() const { return last; }
+};
+
+// the moves of one position, pointing into the mapped file
+struct bookMoveRange {
+    const bookMove* first;
+    const bookMove* last;
+    const bookMove* begin() const { return first; }
+    const bookMove* end() const { return last; }
+};
+
+// a book mapped into memory. Lookups don't copy or allocate
+class openingBook {
+ public:
+    openingBook() = default;
+    openingBook(const openingBook&) = delete;
+    openingBook& operator=(const openingBook&) = delete;
+    ~openingBook();
+    // false if the file can't be mapped or isn't a book
+    bool open(const std::string& path);
+    bool canonical() const { return header->flags & bookCanonical; }
+    const std::string& path() const { return filePath; }
+    uint64_t positionCount() const { return header->positionCount; }
+    uint64_t moveCount() const { return header->moveCount; }
+    // the position's counts, one record per bucket. Empty if it isn't in the book
+    bookPositionRange findPosition(const positionKey& key) const;
+    // every move played from the position with this database key, in every bucket
+    bookMoveRange findMoves(int64_t parentKey) const;
+    // every record, in file order
+    const bookPosition* positionData() const { return positions; }
+    const bookMove* moveData() const { return moves; }
+
+ private:
+    std::string filePath;
+    const char* map = nullptr;
+    size_t mapSize = 0;
+    const bookHeader* header = nullptr;
+    const bookPosition* positions = nullptr;
+    const bookMove* moves = nullptr;
+    const int64_t* positionFences = nullptr;
+    const int64_t* moveFences = nullptr;
+    uint64_t positionFenceCount = 0;
+    uint64_t moveFenceCount = 0;
+};
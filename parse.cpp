@@ -1,209 +1,717 @@
 // Copyright Andrew Bernal 2023
 #include <pqxx/pqxx>
-#include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <filesystem>
+#include <iostream>
 #include <fstream>
-#include <sstream>
+#include <map>
+#include <memory>
 #include <string>
-#include <cctype>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "bookExport.hpp"
+#include "countMinSketch.hpp"
+#include "gameFilter.hpp"
+#include "ingestStats.hpp"
+#include "lsmStorage.hpp"
+#include "moveCode.hpp"
+#include "pgnReader.hpp"
+#include "pgnSource.hpp"
+#include "positionAggregate.hpp"
+#include "positionStorage.hpp"
+#include "postRecord.hpp"
+#include "replay.hpp"
+#include "workQueue.hpp"
 
-std::string extractMove(std::ifstream& pgn_file);
-void insertToDatabase(pqxx::work& txn, std::string fen, std::string result, std::string move);
+// everything from the command line and configuration.txt
+struct ingestSettings {
+    unsigned int threads = 1;
+    bool initialLoad = false;
+    bool resume = false;
+    std::string pgnLocation;
+    std::string databaseConnectionString;
+    // postgres, sqlite, lsm or memory
+    std::string storage = "postgres";
+    std::string sqliteLocation;
+    std::string lsmLocation;
+    std::string postProcessedPgnLocation;
+    size_t aggregateMemoryMB = 2048;
+    // also write the FEN of every position, which the programs don't need
+    bool storeFen = false;
+    // key positions without their move counters, so transpositions are one row
+    bool canonicalPositions = false;
+    // --prune removes positions and moves played in fewer games than this
+    int pruneMinGames = 6;
+    // and moves them to cold tables instead of deleting them
+    bool pruneToCold = false;
+    // postgres: rewrite the tables after a prune with VACUUM FULL instead of a plain VACUUM
+    bool pruneVacuumFull = false;
+    // --sketch counts every position in a first pass over the PGN, and the second pass only
+    // stores the ones that were played in at least pruneMinGames games
+    bool sketch = false;
+    size_t sketchMemoryMB = 1024;
+    // where --export-book writes the opening book
+    std::string openingBookLocation;
+    // the directory --delta writes a month to, as <month>.book, and --apply-delta reads it from
+    std::string deltaLocation;
+    gameFilter filter;
+    // where the stats lines go, stdout if empty
+    std::string statsLocation;
+    int statsIntervalSeconds = 10;
+};
+
+// the PGN is handed to the worker threads in chunks of whole games about this big
+const size_t chunkSize = 16 << 20;
+
+// what a worker thread produces from one chunk of the PGN
+struct chunkResult {
+    positionAggregate aggregate;
+    // records for the post-processed file
+    std::string postRecords;
+    ingestCounters counters;
+    int64_t games = 0;
+    int64_t sequence = 0;
+    uint64_t endOffset = 0;
+};
+
+// replays the lichess PGN into the database, writing the post-processed file as it goes
+int ingestPgn(const ingestSettings& settings);
+// loads the database from a post-processed file instead of the PGN
+int rebuildFromPost(const ingestSettings& settings);
+// the first pass of --sketch, counting every position of the accepted games
+bool sketchPgn(const ingestSettings& settings, bool canonical, countMinSketch& sketch);
+void sketchChunk(std::string_view chunk, const ingestSettings& settings, bool canonical,
+    countMinSketch& sketch);
+// removes the rare positions and moves from the storage
+int pruneStorage(const ingestSettings& settings);
+// writes the runs of a --delta ingest out as the month's one sorted book, and deletes them
+int writeDelta(const ingestSettings& settings, const std::string& month);
+// adds the month's delta book to the storage, unless it was added before
+int applyDelta(const ingestSettings& settings, const std::string& month);
+// the storage to ingest into, with checkpoints kept under source
+std::unique_ptr<positionStorage> openIngestStorage(const ingestSettings& settings,
+    const std::string& source);
+// the stream the stats lines are written to
+std::ostream& openStatsOutput(const ingestSettings& settings, std::ofstream& file);
+// positions the sketch has seen in fewer than pruneMinGames games are left out, if there is one
+void processChunk(std::string_view chunk, const ingestSettings& settings, bool canonical,
+    const countMinSketch* sketch, chunkResult& out);
 
 int main(int argc, char *argv[]) {
-    /*if (argc != 3) {
-        std::cerr << "Usage: " << argv[0] << " [PGN file] [database connection string]" << std::endl;
-        return 1;
-    }*/
+    ingestSettings settings;
+    bool fromPost = false;
+    bool exportBook = false;
+    bool prune = false;
+    std::string deltaMonth;
+    std::string applyMonth;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--threads" && i + 1 < argc) {
+            settings.threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--initial-load") {
+            settings.initialLoad = true;
+        } else if (arg == "--resume") {
+            settings.resume = true;
+        } else if (arg == "--from-post") {
+            fromPost = true;
+        } else if (arg == "--export-book") {
+            exportBook = true;
+        } else if (arg == "--prune") {
+            prune = true;
+        } else if (arg == "--sketch") {
+            settings.sketch = true;
+        } else if (arg == "--delta" && i + 1 < argc) {
+            deltaMonth = argv[++i];
+        } else if (arg == "--apply-delta" && i + 1 < argc) {
+            applyMonth = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0]
+                << " [--threads N] [--initial-load] [--resume] [--from-post] [--export-book]"
+                << " [--prune] [--sketch] [--delta MONTH] [--apply-delta MONTH]" << std::endl;
+            return 1;
+        }
+    }
     // load the values from the config file
     std::ifstream configFile("configuration.txt");
     std::string inpLine;
-    std::string pgnLocation;
-    std::string databaseConnectionString;
-    std::string preprocessedPgnLocation;
-    std::string postProcessedPgnLocation;
     while (std::getline(configFile, inpLine)) {
         if (inpLine.find("lichessLocation") != std::string::npos) {
-            pgnLocation = inpLine.substr(inpLine.find("=") + 1);
-        } else if (inpLine.find("preprocessingLocation") != std::string::npos) {
-            preprocessedPgnLocation = inpLine.substr(inpLine.find("=") + 1);
+            settings.pgnLocation = inpLine.substr(inpLine.find("=") + 1);
         } else if (inpLine.find("postprocessingLocation") != std::string::npos) {
-            postProcessedPgnLocation = inpLine.substr(inpLine.find("=") + 1);
+            settings.postProcessedPgnLocation = inpLine.substr(inpLine.find("=") + 1);
         } else if (inpLine.find("databaseConnectionString") != std::string::npos) {
-            databaseConnectionString = inpLine.substr(inpLine.find("=") + 1);
+            settings.databaseConnectionString = inpLine.substr(inpLine.find("=") + 1);
+        } else if (inpLine.find("sqliteLocation") != std::string::npos) {
+            settings.sqliteLocation = inpLine.substr(inpLine.find("=") + 1);
+        } else if (inpLine.find("lsmLocation") != std::string::npos) {
+            settings.lsmLocation = inpLine.substr(inpLine.find("=") + 1);
+        } else if (inpLine.find("deltaLocation") != std::string::npos) {
+            settings.deltaLocation = inpLine.substr(inpLine.find("=") + 1);
+        } else if (inpLine.find("storage") != std::string::npos) {
+            settings.storage = inpLine.substr(inpLine.find("=") + 1);
+        } else if (inpLine.find("aggregateMemoryMB") != std::string::npos) {
+            settings.aggregateMemoryMB = std::stoul(inpLine.substr(inpLine.find("=") + 1));
+        } else if (inpLine.find("canonicalPositions") != std::string::npos) {
+            settings.canonicalPositions = inpLine.substr(inpLine.find("=") + 1) == "true";
+        } else if (inpLine.find("pruneMinGames") != std::string::npos) {
+            settings.pruneMinGames = std::stoi(inpLine.substr(inpLine.find("=") + 1));
+        } else if (inpLine.find("sketchMemoryMB") != std::string::npos) {
+            settings.sketchMemoryMB = std::stoul(inpLine.substr(inpLine.find("=") + 1));
+        } else if (inpLine.find("pruneVacuumFull") != std::string::npos) {
+            settings.pruneVacuumFull = inpLine.substr(inpLine.find("=") + 1) == "true";
+        } else if (inpLine.find("pruneToCold") != std::string::npos) {
+            settings.pruneToCold = inpLine.substr(inpLine.find("=") + 1) == "true";
+        } else if (inpLine.find("openingBookLocation") != std::string::npos) {
+            settings.openingBookLocation = inpLine.substr(inpLine.find("=") + 1);
+        } else if (inpLine.find("storeFen") != std::string::npos) {
+            settings.storeFen = inpLine.substr(inpLine.find("=") + 1) == "true";
+        } else if (inpLine.find("statsLocation") != std::string::npos) {
+            settings.statsLocation = inpLine.substr(inpLine.find("=") + 1);
+        } else if (inpLine.find("statsIntervalSeconds") != std::string::npos) {
+            settings.statsIntervalSeconds = std::stoi(inpLine.substr(inpLine.find("=") + 1));
+            // the reporter would write lines as fast as it can
+            if (settings.statsIntervalSeconds <= 0) {
+                std::cerr << "statsIntervalSeconds has to be at least 1" << std::endl;
+                return 1;
+            }
+        } else {
+            settings.filter.configure(inpLine);
         }
     }
 
-    // where to store the post-processed pgn (so it doesn't have to be recomputed)
-    std::ofstream outputPgn(postProcessedPgnLocation);
-
-    // Check if the pre-processed pgn exists
-    std::filesystem::path filePath = preprocessedPgnLocation;
-    if (std::filesystem::exists(filePath)) {
-        std::cout << "File exists. Skipping parsing.\n";
-    } else {
-        // Pre-process the PGN file using pgn-extract
-        std::string pgn_extract_cmd = "pgn-extract --fencomments -C -N -V ";
-        pgn_extract_cmd += pgnLocation;
-        pgn_extract_cmd += " -o" + preprocessedPgnLocation;
-        pgn_extract_cmd += " >/dev/null 2>&1";
-        int status = system(pgn_extract_cmd.c_str());
-        if (status != 0) {
-            std::cerr << "Failed to execute pgn-extract command" << std::endl;
+    if (exportBook) {
+        if (settings.openingBookLocation.empty()) {
+            std::cerr << "Set openingBookLocation to export the book" << std::endl;
             return 1;
         }
+        // the database is already built, this only writes it out for the repertoireBuilder.
+        // It is read straight from postgres, the other storages are small enough to not need it
+        pqxx::connection conn(settings.databaseConnectionString);
+        return exportOpeningBook(conn, settings.openingBookLocation) ? 0 : 1;
+    }
+    if (prune) {
+        return pruneStorage(settings);
+    }
+    if ((!deltaMonth.empty() || !applyMonth.empty()) && settings.deltaLocation.empty()) {
+        std::cerr << "Set deltaLocation to ingest or apply a month on its own" << std::endl;
+        return 1;
+    }
+    if (!applyMonth.empty()) {
+        return applyDelta(settings, applyMonth);
+    }
+    if (!deltaMonth.empty()) {
+        // the month is ingested into a store of its own, in sorted runs that never have to be
+        // updated in place, with its own post-processed file and checkpoints
+        settings.storage = "lsm";
+        settings.lsmLocation = settings.deltaLocation + "/" + deltaMonth + ".lsm";
+        settings.postProcessedPgnLocation = settings.deltaLocation + "/" + deltaMonth + ".post";
+        settings.initialLoad = false;
+        std::filesystem::create_directories(settings.deltaLocation);
+    }
+    if (settings.sketch && (settings.pruneMinGames < 1 ||
+        settings.pruneMinGames > static_cast<int>(countMinSketch::maxCount))) {
+        std::cerr << "--sketch needs pruneMinGames between 1 and " << countMinSketch::maxCount
+            << std::endl;
+        return 1;
+    }
+    int result = fromPost ? rebuildFromPost(settings) : ingestPgn(settings);
+    if (result != 0 || deltaMonth.empty()) {
+        return result;
+    }
+    return writeDelta(settings, deltaMonth);
+}
+
+int ingestPgn(const ingestSettings& settings) {
+    // Open the raw lichess PGN. The moves are replayed here, so there is no pre-processing step
+    // a .pgn.zst is decompressed as it is read
+    std::unique_ptr<pgnSource> source = openPgnSource(settings.pgnLocation);
+    if (!source) {
+        std::cerr << "Failed to open " << settings.pgnLocation << std::endl;
+        return 1;
+    }
+    pgnReader reader(*source);
+
+    std::unique_ptr<positionStorage> storage = openIngestStorage(settings, settings.pgnLocation);
+    if (!storage) {
+        return 1;
     }
 
-    // Open the pre-processed PGN file
-    std::ifstream pgn_file("/tmp/lichess.pgn");
-    if (!pgn_file.is_open()) {
-        std::cerr << "Failed to open /tmp/lichess.pgn" << std::endl;
-        return 1;
-    }
-
-    // Connect to the PostgreSQL database
-    pqxx::connection conn(databaseConnectionString);
-    pqxx::work txn(conn);
-
-    double linesRead = 0;
-    int multiplier = 0;
-    // Parse the PGN data
-    std::string line;
-    char c;
-    // getline until it is no longer the pgn header.
-    // Then switch to processing FENs and moves char by char
-    while (!pgn_file.eof()) {
-        std::string result, numberString;
-        double avgRating =  -1;
-        // they need to have some value to use O3. The low average will cause them to not be parsed
-        int whiteElo = INT32_MIN, blackElo = INT32_MIN;
-        bool moreMoves = true;
-
-        // if c is [, then read the line. Otherwise parse the FEN char by char
-        while (std::getline(pgn_file, line), line.find('[') != std::string::npos) {
-            linesRead++;
-            if (line.find("Result") != std::string::npos) {
-                // results can be of varying lengths, but they are always between two ""
-                result = line.substr(line.find("\"") + 1);
-                result = result.substr(0, result.find("\""));
-            } else if (line.find("WhiteElo") != std::string::npos) {
-                // elo can be of varying lengths, but thet are always between two ""
-                numberString = line.substr(line.find("\"") + 1);
-                numberString = numberString.substr(0, numberString.find("\""));
-                std::cout << "W:" << numberString << "\n";
-                if (numberString != "?") {
-                    whiteElo = stoi(numberString);
-                } else {
-                    continue;
+    // the first pass only counts, so rare positions are never aggregated or written.
+    // The sketch isn't saved, a resumed run counts the whole file again
+    std::unique_ptr<countMinSketch> sketch;
+    if (settings.sketch) {
+        sketch = std::make_unique<countMinSketch>(settings.sketchMemoryMB << 20);
+        if (!sketchPgn(settings, storage->canonical(), *sketch)) {
+            return 1;
+        }
+    }
+
+    // pick up after the last batch that made it into the database
+    ingestCheckpoint checkpoint;
+    bool resuming = settings.resume && storage->loadCheckpoint(checkpoint);
+    if (resuming) {
+        std::cerr << "Resuming after " << checkpoint.games << " games, at byte "
+            << checkpoint.byteOffset << "\n";
+        reader.skip(checkpoint.byteOffset);
+        // drop the records written after the checkpoint, they will be written again
+        if (std::filesystem::exists(settings.postProcessedPgnLocation)) {
+            std::filesystem::resize_file(settings.postProcessedPgnLocation,
+                checkpoint.postBytes);
+        }
+    }
+
+    // where to store the post-processed records (so they don't have to be recomputed)
+    std::ofstream outputPost(settings.postProcessedPgnLocation, std::ios::binary |
+        (resuming ? std::ios::app : std::ios::trunc));
+    if (!resuming) {
+        outputPost.write(postFileMagic, sizeof(postFileMagic));
+    }
+
+    std::ofstream statsFile;
+    ingestStats stats(openStatsOutput(settings, statsFile),
+        std::chrono::seconds(settings.statsIntervalSeconds), [&] { return reader.bytesRead(); });
+
+    // The reader thread cuts the PGN into chunks of whole games, the workers replay them into
+    // their own aggregates, and this thread merges the aggregates and writes them to the database
+    workQueue<pgnChunk> chunks(settings.threads * 2);
+    workQueue<chunkResult> results(settings.threads * 2);
+
+    // a broken input must not look like its end, or the games after the break would look like
+    // they aren't there
+    std::atomic<bool> readFailed(false);
+    std::thread readerThread([&] {
+        pgnChunk chunk;
+        ingestCounters counters;
+        auto start = std::chrono::steady_clock::now();
+        while (reader.nextChunk(chunk, chunkSize)) {
+            counters.read.record(std::chrono::steady_clock::now() - start);
+            stats.add(counters);
+            counters = ingestCounters();
+            if (!chunks.push(std::move(chunk))) {
+                break;
+            }
+            start = std::chrono::steady_clock::now();
+        }
+        readFailed = reader.failed();
+        chunks.close();
+    });
+
+    std::vector<std::thread> workers;
+    std::atomic<unsigned int> runningWorkers(settings.threads);
+    for (unsigned int i = 0; i < settings.threads; i++) {
+        workers.emplace_back([&] {
+            pgnChunk chunk;
+            while (chunks.pop(chunk)) {
+                chunkResult result;
+                result.sequence = chunk.sequence;
+                result.endOffset = chunk.endOffset;
+                processChunk(chunk.text(), settings, storage->canonical(), sketch.get(), result);
+                stats.add(result.counters);
+                if (!results.push(std::move(result))) {
+                    break;
                 }
-            } else if (line.find("BlackElo") != std::string::npos) {
-                // elo can be of varying lengths, but thet are always between two ""
-                numberString = line.substr(line.find("\"") + 1);
-                numberString = numberString.substr(0, numberString.find("\""));
-                std::cout << "B:" << numberString << "\n";
-                if (numberString != "?") {
-                    blackElo = stoi(numberString);
-                } else {
-                    continue;
+            }
+            // the last worker out tells the writer there is nothing more coming
+            if (--runningWorkers == 0) {
+                results.close();
+            }
+        });
+    }
+
+    // positions are merged here until the memory budget is hit, then written in one go.
+    // Popular positions are played millions of times but cost one row per flush
+    positionAggregate pending;
+    // workers finish chunks out of order. They are merged in input order, so that a checkpoint
+    // can say everything before its offset is in the database
+    std::map<int64_t, chunkResult> waiting;
+    int64_t nextSequence = 0;
+    chunkResult result;
+    bool moreResults = true;
+    try {
+        while (moreResults) {
+            moreResults = results.pop(result);
+            if (moreResults) {
+                int64_t sequence = result.sequence;
+                waiting.emplace(sequence, std::move(result));
+            }
+            for (auto it = waiting.find(nextSequence); it != waiting.end();
+                it = waiting.find(++nextSequence)) {
+                checkpoint.games += it->second.games;
+                checkpoint.byteOffset = it->second.endOffset;
+                outputPost << it->second.postRecords;
+                mergeAggregate(pending, it->second.aggregate);
+                waiting.erase(it);
+            }
+            if (pending.memoryBytes() > settings.aggregateMemoryMB << 20 ||
+                (!moreResults && !pending.positions.empty() && !readFailed)) {
+                std::cerr << "Writing " << pending.positions.size() << " positions and "
+                    << pending.moves.size() << " moves\n";
+                outputPost.flush();
+                checkpoint.postBytes = outputPost.tellp();
+                ingestCounters counters;
+                {
+                    scopeTimer timer(counters.flush);
+                    storage->flush(pending, checkpoint);
                 }
+                counters.flushes = 1;
+                counters.flushedRows = pending.positions.size() + pending.moves.size();
+                stats.add(counters);
+                std::cerr << "Read " << checkpoint.games << " games, " << checkpoint.byteOffset
+                    << " bytes\n";
+                pending.clear();
             }
         }
-        // avgRating is useful, as it lets us skip parsing entries below a certain rating.
-        // skipping entries means the output file / database can be 90% smaller
-        avgRating = whiteElo + blackElo / 2.0;
-
-        if (avgRating > 2000) {
-            // now the header part is done, and we can continue parsing the FENs
-            while (moreMoves) {
-                std::string fen, move;
-                while (pgn_file.get(c), c != '{') { linesRead += 0.02; }
-                if (c == '{') {
-                    while (pgn_file.get(c), c != '}') {
-                        linesRead += 0.02;
-                        // add everything besides the newlines to the fen
-                        if (c != '\n') {
-                            fen += c;
-                        } else {
-                            fen += " ";
-                        }
-                    }
-                    // first and last char are a <space>
-                    // odd edge case where the first char is a newline or something
-                    // and in that case the first space is the b KQkq part of the FEN
-                    // which is wrong
-                    std::size_t spaceIndex = fen.find(" ");
-                    if (spaceIndex < 4) {
-                        fen = fen.substr(fen.find(" ") + 1);
-                    }
-                    std::size_t lastNonSpace = fen.find_last_not_of(' ');
-                    fen = fen.substr(0, lastNonSpace + 1);
+    } catch (const std::exception& e) {
+        // the reader and the workers would wait forever on the full queues
+        chunks.close();
+        results.close();
+        readerThread.join();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        std::cerr << "Writing to the storage failed: " << e.what() << std::endl;
+        return 1;
+    }
 
-                    move = extractMove(pgn_file);
+    readerThread.join();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (readFailed) {
+        // nothing after the last flush is written, so its checkpoint is where to resume
+        std::cerr << "Stopped reading " << settings.pgnLocation << " before its end. The games "
+            << "up to the last checkpoint are stored, fix the file and run again with --resume"
+            << std::endl;
+        return 1;
+    }
+    try {
+        storage->finish();
+    } catch (const std::exception& e) {
+        std::cerr << "Writing to the storage failed: " << e.what() << std::endl;
+        return 1;
+    }
 
-                    // edge case at the end of the game
-                    if (move == "Event") {
-                        move = "";
-                        moreMoves = false;
-                    }
-                // std::cout << avgRating << ":" << fen << ":" << result << ":" << move << "\n";
-                    insertToDatabase(txn, fen, result, move);
-                    outputPgn << avgRating << ":" << fen << ":" << result << ":" << move << "\n";
+    return 0;
+}
+
+int rebuildFromPost(const ingestSettings& settings) {
+    std::FILE* file = std::fopen(settings.postProcessedPgnLocation.c_str(), "rb");
+    if (file == nullptr) {
+        std::cerr << "Failed to open " << settings.postProcessedPgnLocation << std::endl;
+        return 1;
+    }
+    postReader reader(file);
+    if (!reader.valid()) {
+        std::cerr << settings.postProcessedPgnLocation << " is not a post-processed file"
+            << std::endl;
+        return 1;
+    }
+
+    // the checkpoints of a rebuild are kept under the post file's name
+    std::unique_ptr<positionStorage> storage = openIngestStorage(settings,
+        settings.postProcessedPgnLocation);
+    if (!storage) {
+        return 1;
+    }
+    ingestCheckpoint checkpoint;
+    if (settings.resume && storage->loadCheckpoint(checkpoint)) {
+        std::cerr << "Resuming at byte " << checkpoint.byteOffset << "\n";
+        reader.seek(checkpoint.byteOffset);
+    }
+
+    std::ofstream statsFile;
+    ingestStats stats(openStatsOutput(settings, statsFile),
+        std::chrono::seconds(settings.statsIntervalSeconds), [&] { return reader.bytesRead(); });
+
+    // the records are already replayed, so this is just counting and writing
+    positionAggregate pending;
+    ingestCounters counters;
+    postRecord record;
+    // the previous record of the same game, if it had a move
+    int64_t parentKey = 0;
+    moveCode parentMove = noMove;
+    bool moreRecords = true;
+    try {
+        while (moreRecords) {
+            moreRecords = reader.next(record);
+            if (moreRecords && record.ratingSum > 2 * settings.filter.minAverageRating &&
+                record.result != unknownResult) {
+                gameBucket bucket = makeBucket(record.ratingSum, record.speed);
+                addPosition(pending, record.key, bucket, record.result);
+                int64_t key = databaseKey(record.key);
+                if (parentMove != noMove) {
+                    addMove(pending, parentKey, parentMove, key, bucket, record.result);
                 }
+                parentKey = key;
+                parentMove = record.move;
+                counters.positions++;
+            } else {
+                parentMove = noMove;
             }
-            if (linesRead > 1500 * multiplier) {
-                std::cout << "Read " << linesRead << " lines\n";
-                // Commit the transaction. Not too often
-                txn.commit();
-                multiplier++;
+            // only flushed between games (the last record of a game has no move), so a resumed
+            // rebuild doesn't lose the move into its first position
+            if ((pending.memoryBytes() > settings.aggregateMemoryMB << 20 &&
+                parentMove == noMove) || (!moreRecords && !pending.positions.empty())) {
+                std::cerr << "Writing " << pending.positions.size() << " positions and "
+                    << pending.moves.size() << " moves\n";
+                checkpoint.byteOffset = reader.bytesRead();
+                {
+                    scopeTimer timer(counters.flush);
+                    storage->flush(pending, checkpoint);
+                }
+                counters.flushes++;
+                counters.flushedRows += pending.positions.size() + pending.moves.size();
+                stats.add(counters);
+                counters = ingestCounters();
+                pending.clear();
             }
-        // otherwise continue reading lines until you get to the next game
-        } else {
-            while (std::getline(pgn_file, line), line.find('[') != std::string::npos) {}
         }
+        storage->finish();
+    } catch (const std::exception& e) {
+        std::cerr << "Writing to the storage failed: " << e.what() << std::endl;
+        return 1;
     }
 
-    // Commit the transaction
-    txn.commit();
-
     return 0;
 }
 
-std::string extractMove(std::ifstream& pgn_file) {
-    std::string move;
-    char c;
-    // we stop on an alpha character. That char is the start of move (which is also the child)
-    // Not the first alphanum, as there is the "1." move number which we do not want
-    while (pgn_file.get(c), !isalpha(c)) {}
-
-    move += c;
-    // I'm not sure about the edge case of '\n', but I don't want to think about it
-    // check if alnum or castling has the - in it (for O-O)
-    while (pgn_file.get(c), !pgn_file.eof() && (isalnum(c) || c == '-') && c != '\n') {
-        if (c != '\n') {
-            move += c;
+bool sketchPgn(const ingestSettings& settings, bool canonical, countMinSketch& sketch) {
+    std::unique_ptr<pgnSource> source = openPgnSource(settings.pgnLocation);
+    if (!source) {
+        std::cerr << "Failed to open " << settings.pgnLocation << std::endl;
+        return false;
+    }
+    pgnReader reader(*source);
+    workQueue<pgnChunk> chunks(settings.threads * 2);
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < settings.threads; i++) {
+        workers.emplace_back([&] {
+            pgnChunk chunk;
+            while (chunks.pop(chunk)) {
+                sketchChunk(chunk.text(), settings, canonical, sketch);
+            }
+        });
+    }
+    pgnChunk chunk;
+    while (reader.nextChunk(chunk, chunkSize)) {
+        chunks.push(std::move(chunk));
+    }
+    chunks.close();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (reader.failed()) {
+        std::cerr << "Stopped reading " << settings.pgnLocation << " in the first pass"
+            << std::endl;
+        return false;
+    }
+    std::cerr << "Counted " << sketch.total() << " positions in the first pass\n";
+    return true;
+}
+
+void sketchChunk(std::string_view chunk, const ingestSettings& settings, bool canonical,
+    countMinSketch& sketch) {
+    memorySource source(chunk);
+    pgnReader reader(source);
+    pgnGame game;
+    while (reader.nextHeaders(game)) {
+        double avgRating;
+        if (!settings.filter.accepts(game, avgRating)) {
+            continue;
         }
+        reader.readMovetext(game);
+        replayGame(game.movetext, [&](thc::ChessRules& position, const thc::Move&,
+            const std::string&) {
+            sketch.add(databaseKey(makePositionKey(position, canonical)));
+        });
+    }
+}
+
+int pruneStorage(const ingestSettings& settings) {
+    storageOptions options;
+    options.kind = settings.storage;
+    options.databaseConnectionString = settings.databaseConnectionString;
+    options.sqliteLocation = settings.sqliteLocation;
+    options.lsmLocation = settings.lsmLocation;
+    options.canonical = settings.canonicalPositions;
+    options.vacuumFull = settings.pruneVacuumFull;
+    std::unique_ptr<positionStorage> storage = openStorage(options);
+    if (!storage) {
+        return 1;
+    }
+    if (!storage->writable()) {
+        std::cerr << "Can't prune " << settings.storage << " storage" << std::endl;
+        return 1;
+    }
+    // buildTree skips black moves from 5 games or fewer, so the default floor mostly drops
+    // rows it would never have followed
+    pruneResult pruned = storage->prune(settings.pruneMinGames, settings.pruneToCold);
+    std::cout << (settings.pruneToCold ? "Moved " : "Deleted ") << pruned.positions
+        << " positions and " << pruned.moves << " moves played in fewer than "
+        << settings.pruneMinGames << " games\n";
+    return 0;
+}
+
+int writeDelta(const ingestSettings& settings, const std::string& month) {
+    storageOptions options;
+    options.kind = "lsm";
+    options.lsmLocation = settings.lsmLocation;
+    options.canonical = settings.canonicalPositions;
+    std::string path = settings.deltaLocation + "/" + month + ".book";
+    try {
+        lsmStorage delta(options);
+        delta.open();
+        delta.exportBook(path);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    std::filesystem::remove_all(settings.lsmLocation);
+    std::cout << "Wrote the delta of " << month << " to " << path
+        << ", add it with --apply-delta " << month << "\n";
+    return 0;
+}
+
+int applyDelta(const ingestSettings& settings, const std::string& month) {
+    std::string path = settings.deltaLocation + "/" + month + ".book";
+    openingBook delta;
+    if (!delta.open(path)) {
+        std::cerr << "Failed to open the delta " << path << std::endl;
+        return 1;
+    }
+    if (settings.storage == "memory") {
+        std::cerr << "The memory storage isn't kept, there is nothing to add a month to"
+            << std::endl;
+        return 1;
+    }
+    ingestSettings applySettings = settings;
+    applySettings.initialLoad = false;
+    std::unique_ptr<positionStorage> storage = openIngestStorage(applySettings, path);
+    if (!storage) {
+        return 1;
+    }
+    // the delta's keys have to be made the same way as the storage's
+    if (delta.canonical() != storage->canonical()) {
+        std::cerr << path << " was built with canonicalPositions=" <<
+            (delta.canonical() ? "true" : "false") << std::endl;
+        return 1;
+    }
+    if (!storage->applyDelta(delta, month)) {
+        std::cerr << month << " was already applied" << std::endl;
+        return 1;
     }
-    return move;
+    storage->finish();
+    std::cout << "Applied " << month << ": " << delta.positionCount() << " positions and "
+        << delta.moveCount() << " moves\n";
+    return 0;
+}
+
+std::unique_ptr<positionStorage> openIngestStorage(const ingestSettings& settings,
+    const std::string& source) {
+    storageOptions options;
+    options.kind = settings.storage;
+    options.databaseConnectionString = settings.databaseConnectionString;
+    options.sqliteLocation = settings.sqliteLocation;
+    options.lsmLocation = settings.lsmLocation;
+    options.canonical = settings.canonicalPositions;
+    options.ingest = true;
+    options.source = source;
+    options.initialLoad = settings.initialLoad;
+    options.resume = settings.resume;
+    options.storeFen = settings.storeFen;
+    std::unique_ptr<positionStorage> storage = openStorage(options);
+    if (storage && !storage->writable()) {
+        std::cerr << "Can't ingest into " << settings.storage << " storage" << std::endl;
+        return nullptr;
+    }
+    return storage;
 }
 
-void insertToDatabase(pqxx::work& txn, std::string fen, std::string result, std::string move) {
-    // Format the move as a PostgreSQL array literal
-    move = "{" + move + "}";
-
-    // insert the fen, result, and move into the database
-    // only append the child move if it does not already exist in the database
-    txn.exec_params(
-        "INSERT INTO lichess (fen, white_wins, black_wins, draws, children_moves) "
-        "VALUES ($1, $2, $3, $4, $5) "
-        "ON CONFLICT (fen) DO UPDATE SET "
-        "white_wins = lichess.white_wins + $2, "
-        "black_wins = lichess.black_wins + $3, "
-        "draws = lichess.draws + $4, "
-        "children_moves = CASE WHEN NOT (lichess.children_moves && $5) "
-        "THEN array_cat(lichess.children_moves, $5) ELSE lichess.children_moves END",
-        fen,
-        result == "1-0" ? 1 : 0,
-        result == "0-1" ? 1 : 0,
-        result == "1/2-1/2" ? 1 : 0,
-        move);
+std::ostream& openStatsOutput(const ingestSettings& settings, std::ofstream& file) {
+    // the progress messages of an ingest go to stderr, so stdout is only the JSON lines
+    if (settings.statsLocation.empty()) {
+        return std::cout;
+    }
+    file.open(settings.statsLocation, std::ios::app);
+    return file;
+}
+
+void processChunk(std::string_view chunk, const ingestSettings& settings, bool canonical,
+    const countMinSketch* sketch, chunkResult& out) {
+    memorySource source(chunk);
+    pgnReader reader(source);
+    pgnGame game;
+    postRecord record;
+    ingestCounters& counters = out.counters;
+    auto parseStart = std::chrono::steady_clock::now();
+    // most games are rejected by their headers, and their moves are skipped without being read
+    while (reader.nextHeaders(game)) {
+        out.games++;
+        counters.games++;
+        double avgRating;
+        if (!settings.filter.accepts(game, avgRating)) {
+            counters.rejectedGames++;
+            counters.parse.record(std::chrono::steady_clock::now() - parseStart);
+            parseStart = std::chrono::steady_clock::now();
+            continue;
+        }
+        counters.acceptedGames++;
+        record.result = resultFromTag(game.tag("Result"));
+        record.ratingSum = static_cast<uint16_t>(avgRating * 2);
+        record.speed = speedFromTimeControl(game.tag("TimeControl"));
+        gameBucket bucket = makeBucket(record.ratingSum, record.speed);
+        reader.readMovetext(game);
+        counters.parse.record(std::chrono::steady_clock::now() - parseStart);
+
+        // now the header part is done, and we can replay the moves
+        {
+            scopeTimer timer(counters.replay);
+            int64_t parentKey = 0;
+            moveCode parentMove = noMove;
+            // the post file only gets the positions that are kept, or --from-post would load
+            // what the sketch left out. A record is held back until it is known whether the
+            // next position is kept, since its move can't be rebuilt if it isn't
+            postRecord held;
+            bool holding = false;
+            replayGame(game.movetext, [&](thc::ChessRules& position, const thc::Move& move,
+                const std::string&) {
+                record.key = makePositionKey(position, canonical);
+                // the final position has an invalid move, which encodes as noMove
+                record.move = encodeMove(move);
+                int64_t key = databaseKey(record.key);
+                // a move is never played more often than the positions on either side of it,
+                // so the moves of a rare position are left out with it
+                bool kept = sketch == nullptr ||
+                    sketch->estimate(key) >= static_cast<unsigned int>(settings.pruneMinGames);
+                if (kept) {
+                    addPosition(out.aggregate, record.key, bucket, record.result);
+                }
+                // the move that got here from the previous position
+                if (parentMove != noMove && kept) {
+                    addMove(out.aggregate, parentKey, parentMove, key, bucket, record.result);
+                }
+                parentKey = key;
+                parentMove = kept ? record.move : noMove;
+                if (holding) {
+                    if (!kept) {
+                        held.move = noMove;
+                    }
+                    appendPostRecord(out.postRecords, held);
+                }
+                held = record;
+                holding = kept;
+                counters.positions++;
+            });
+            if (holding) {
+                appendPostRecord(out.postRecords, held);
+            }
+        }
+        parseStart = std::chrono::steady_clock::now();
+    }
 }
@@ -0,0 +1,224 @@
+// Copyright Andrew Bernal 2023
+#include "pgnReader.hpp"
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+std::string_view pgnGame::tag(std::string_view name) const {
+    size_t lineStart = 0;
+    while (lineStart < headers.size()) {
+        size_t lineEnd = headers.find('\n', lineStart);
+        if (lineEnd == std::string_view::npos) {
+            lineEnd = headers.size();
+        }
+        // [Name "value"]
+        std::string_view line = headers.substr(lineStart, lineEnd - lineStart);
+        if (line.size() > name.size() + 1 && line[0] == '[' &&
+            line.compare(1, name.size(), name) == 0 && line[name.size() + 1] == ' ') {
+            size_t open = line.find('"', name.size() + 1);
+            size_t close = line.rfind('"');
+            if (open == std::string_view::npos || close <= open) {
+                return std::string_view();
+            }
+            return line.substr(open + 1, close - open - 1);
+        }
+        lineStart = lineEnd + 1;
+    }
+    return std::string_view();
+}
+
+size_t findBlankLine(std::string_view text, size_t from) {
+    const char* data = text.data();
+    size_t i = from;
+    while (i < text.size()) {
+        const void* newline = std::memchr(data + i, '\n', text.size() - i);
+        if (newline == nullptr) {
+            return std::string_view::npos;
+        }
+        size_t pos = static_cast<const char*>(newline) - data;
+        size_t next = pos + 1;
+        if (next < text.size() && text[next] == '\r') {
+            next++;
+        }
+        if (next < text.size() && text[next] == '\n') {
+            return pos;
+        }
+        i = pos + 1;
+    }
+    return std::string_view::npos;
+}
+
+pgnReader::pgnReader(pgnSource& sourceInp, size_t blockSizeInp)
+    : source(sourceInp), blockSize(blockSizeInp) {}
+
+bool pgnReader::nextGame(pgnGame& game) {
+    if (!nextHeaders(game)) {
+        return false;
+    }
+    readMovetext(game);
+    // nor is one whose moves it broke off in
+    return !source.failed();
+}
+
+bool pgnReader::nextHeaders(pgnGame& game) {
+    if (inGame) {
+        // the caller didn't want the moves of the last game
+        skipGame();
+    }
+    while (true) {
+        // everything before the first [ is the whitespace between games
+        size_t start = pending.find('[');
+        if (start != std::string_view::npos) {
+            size_t headersEnd = findBlankLine(pending, start);
+            if (headersEnd != std::string_view::npos || endOfInput) {
+                headersEnd = std::min(headersEnd, pending.size());
+                consumed += start;
+                pending.remove_prefix(start);
+                headersLength = headersEnd - start;
+                game.headers = pending.substr(0, headersLength);
+                game.movetext = std::string_view();
+                inGame = true;
+                return true;
+            }
+        } else if (endOfInput) {
+            consumed += pending.size();
+            pending = std::string_view();
+            return false;
+        }
+        // the headers run past the end of what has been read so far
+        if (!fill()) {
+            // the source broke, the game it broke off in isn't handed out
+            if (source.failed()) {
+                return false;
+            }
+            endOfInput = true;
+        }
+    }
+}
+
+void pgnReader::readMovetext(pgnGame& game) {
+    size_t movetextStart, movetextEnd;
+    while (true) {
+        movetextStart = pending.find_first_not_of("\r\n", headersLength);
+        if (movetextStart != std::string_view::npos && pending[movetextStart] == '[') {
+            // a game without any moves, the next game starts here
+            movetextEnd = movetextStart;
+            break;
+        } else if (movetextStart != std::string_view::npos) {
+            movetextEnd = findBlankLine(pending, movetextStart);
+            if (movetextEnd != std::string_view::npos) {
+                break;
+            }
+        }
+        if (endOfInput) {
+            movetextStart = std::min(movetextStart, pending.size());
+            movetextEnd = pending.size();
+            break;
+        }
+        // the game runs past the end of what has been read so far
+        if (!fill()) {
+            endOfInput = true;
+        }
+    }
+    // filling the buffer may have moved the headers
+    game.headers = pending.substr(0, headersLength);
+    game.movetext = pending.substr(movetextStart, movetextEnd - movetextStart);
+    consumed += movetextEnd;
+    pending.remove_prefix(movetextEnd);
+    inGame = false;
+}
+
+void pgnReader::skipGame() {
+    // the moves are never looked at, just jump to the next [Event tag
+    size_t end;
+    while (true) {
+        size_t next = pending.find("\n[Event ", headersLength);
+        if (next != std::string_view::npos) {
+            end = next + 1;
+            break;
+        }
+        if (endOfInput) {
+            end = pending.size();
+            break;
+        }
+        if (!fill()) {
+            endOfInput = true;
+        }
+    }
+    consumed += end;
+    pending.remove_prefix(end);
+    inGame = false;
+}
+
+bool pgnReader::nextChunk(pgnChunk& chunk, size_t chunkSize) {
+    size_t end;
+    while (true) {
+        if (pending.size() > chunkSize) {
+            size_t boundary = pending.find("\n[Event ", chunkSize);
+            if (boundary != std::string_view::npos) {
+                end = boundary + 1;
+                break;
+            }
+        }
+        if (endOfInput) {
+            end = pending.size();
+            break;
+        }
+        if (!fill()) {
+            endOfInput = true;
+        }
+    }
+    if (end == 0 || (endOfInput && end == pending.size() && source.failed())) {
+        return false;
+    }
+    if (mappedInput) {
+        chunk.storage.clear();
+        chunk.mappedText = pending.substr(0, end);
+    } else {
+        chunk.storage.assign(pending.data(), end);
+        chunk.mappedText = std::string_view();
+    }
+    consumed += end;
+    pending.remove_prefix(end);
+    chunk.sequence = chunksRead++;
+    chunk.endOffset = consumed;
+    return true;
+}
+
+void pgnReader::skip(uint64_t bytes) {
+    while (bytes > 0) {
+        if (pending.empty() && !fill()) {
+            endOfInput = true;
+            return;
+        }
+        size_t skipped = std::min<uint64_t>(bytes, pending.size());
+        pending.remove_prefix(skipped);
+        consumed += skipped;
+        bytes -= skipped;
+    }
+}
+
+bool pgnReader::fill() {
+    if (endOfInput) {
+        return false;
+    }
+    std::string_view mapped = source.mapped();
+    if (!mapped.empty()) {
+        // the whole file is already in memory
+        pending = mapped;
+        endOfInput = true;
+        mappedInput = true;
+        return true;
+    }
+    size_t keep = pending.size();
+    if (keep > 0) {
+        std::memmove(buffer.data(), pending.data(), keep);
+    }
+    // a single game longer than the buffer, make room for it
+    if (buffer.size() < keep + blockSize) {
+        buffer.resize(keep + blockSize);
+    }
+    size_t bytes = source.read(buffer.data() + keep, buffer.size() - keep);
+    pending = std::string_view(buffer.data(), keep + bytes);
+    return bytes > 0;
+}
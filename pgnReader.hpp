@@ -0,0 +1,79 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "pgnSource.hpp"
+
+// one game of the PGN, as views into the reader's buffer
+struct pgnGame {
+    // all of the [Tag "value"] lines
+    std::string_view headers;
+    std::string_view movetext;
+    // the value of a header tag without the quotes, empty if the game doesn't have it
+    std::string_view tag(std::string_view name) const;
+};
+
+// a run of whole games, handed to one worker thread
+struct pgnChunk {
+    // a copy of the games when the input isn't mapped, empty otherwise
+    std::string storage;
+    std::string_view mappedText;
+    // chunks are numbered in input order
+    int64_t sequence = 0;
+    // bytes of the input up to the end of this chunk
+    uint64_t endOffset = 0;
+    std::string_view text() const {
+        return storage.empty() ? mappedText : std::string_view(storage);
+    }
+};
+
+// splits the PGN into games by scanning whole blocks with memchr instead of reading it a
+// character at a time. Mapped sources are scanned in place, others are read in large blocks
+class pgnReader {
+ public:
+    explicit pgnReader(pgnSource& sourceInp, size_t blockSize = 64 << 20);
+    // false at the end of the input, or when the source failed. The views in game stay valid
+    // until the next call
+    bool nextGame(pgnGame& game);
+    // reads only the headers of the next game, so it can be rejected without touching its moves.
+    // Follow it with readMovetext to get the moves, or call nextHeaders again to skip them
+    bool nextHeaders(pgnGame& game);
+    void readMovetext(pgnGame& game);
+    // the next chunkSize or so bytes of the input, cut at the start of a game (an [Event tag)
+    // so the chunks can be parsed independently. False at the end of the input, or when the
+    // source failed, in which case the game it was cut off in isn't handed out
+    bool nextChunk(pgnChunk& chunk, size_t chunkSize);
+    // throws away the first bytes of the input, to pick up where a checkpoint left off.
+    // A compressed input still has to be decompressed up to there
+    void skip(uint64_t bytes);
+    // bytes of (decompressed) PGN handed out so far. Safe to call from other threads
+    uint64_t bytesRead() const { return consumed.load(std::memory_order_relaxed); }
+    // the input stopped because the source broke, not because it was all read
+    bool failed() const { return source.failed(); }
+
+ private:
+    // reads another block into the buffer, keeping the unconsumed part. False at the end
+    bool fill();
+    // jumps past the moves of the current game to the next [Event tag
+    void skipGame();
+
+    pgnSource& source;
+    size_t blockSize;
+    std::vector<char> buffer;
+    // the part of the input that hasn't been handed out yet
+    std::string_view pending;
+    bool endOfInput = false;
+    // pending points into the source's own memory rather than buffer
+    bool mappedInput = false;
+    // nextHeaders has handed out a game, which starts at the front of pending
+    bool inGame = false;
+    size_t headersLength = 0;
+    std::atomic<uint64_t> consumed{0};
+    int64_t chunksRead = 0;
+};
+
+// position of the blank line that ends the section starting at from, npos if there isn't one yet
+size_t findBlankLine(std::string_view text, size_t from);
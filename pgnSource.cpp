@@ -0,0 +1,98 @@
+// Copyright Andrew Bernal 2023
+#include "pgnSource.hpp"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+
+fileSource::fileSource(std::FILE* fileInp) : file(fileInp) {}
+
+fileSource::~fileSource() {
+    std::fclose(file);
+}
+
+size_t fileSource::read(char* buf, size_t size) {
+    return std::fread(buf, 1, size, file);
+}
+
+size_t memorySource::read(char* buf, size_t size) {
+    size_t bytes = std::min(size, text.size() - offset);
+    std::memcpy(buf, text.data() + offset, bytes);
+    offset += bytes;
+    return bytes;
+}
+
+mmapSource::~mmapSource() {
+    munmap(const_cast<char*>(text.data()), text.size());
+}
+
+zstdSource::zstdSource(std::FILE* fileInp) : file(fileInp), dctx(ZSTD_createDCtx()),
+    inBuf(ZSTD_DStreamInSize()), in{inBuf.data(), 0, 0} {}
+
+zstdSource::~zstdSource() {
+    ZSTD_freeDCtx(dctx);
+    std::fclose(file);
+}
+
+size_t zstdSource::read(char* buf, size_t size) {
+    ZSTD_outBuffer out = {buf, size, 0};
+    while (out.pos == 0) {
+        // only go back to the disk once zstd has handed out everything it decompressed
+        if (in.pos == in.size && !pendingOutput) {
+            in.size = std::fread(inBuf.data(), 1, inBuf.size(), file);
+            in.pos = 0;
+            if (in.size == 0) {
+                if (std::ferror(file)) {
+                    std::cerr << "Failed to read the compressed PGN" << std::endl;
+                    error = true;
+                } else if (frameRemaining != 0) {
+                    std::cerr << "The compressed PGN ends partway through a frame" << std::endl;
+                    error = true;
+                }
+                return 0;
+            }
+        }
+        frameRemaining = ZSTD_decompressStream(dctx, &out, &in);
+        if (ZSTD_isError(frameRemaining)) {
+            std::cerr << "Failed to decompress: " << ZSTD_getErrorName(frameRemaining)
+                << std::endl;
+            error = true;
+            return 0;
+        }
+        pendingOutput = out.pos == out.size;
+    }
+    return out.pos;
+}
+
+std::unique_ptr<pgnSource> openPgnSource(const std::string& path) {
+    bool compressed = path.size() > 4 && path.compare(path.size() - 4, 4, ".zst") == 0;
+    if (!compressed) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (map != MAP_FAILED) {
+                // the file is read front to back once, so let the kernel read ahead aggressively
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                return std::make_unique<mmapSource>(static_cast<const char*>(map), st.st_size);
+            }
+        } else if (fd >= 0) {
+            close(fd);
+        }
+        // not mappable (a pipe, an empty file), fall back to plain reads
+    }
+    std::FILE* file = std::fopen(path.c_str(), "rb");
+    if (file == nullptr) {
+        return nullptr;
+    }
+    if (compressed) {
+        return std::make_unique<zstdSource>(file);
+    }
+    return std::make_unique<fileSource>(file);
+}
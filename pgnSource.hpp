@@ -0,0 +1,77 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <zstd.h>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// where the raw PGN bytes come from. Either a plain .pgn or a lichess .pgn.zst
+class pgnSource {
+ public:
+    virtual ~pgnSource() = default;
+    // fills up to size bytes of buf, returns 0 at the end of the input
+    virtual size_t read(char* buf, size_t size) = 0;
+    // read returned 0 because the input is broken (a read error, corrupt or cut off
+    // compressed data) rather than because it was all read
+    virtual bool failed() const { return false; }
+    // the whole input, if it is already in memory. Empty for sources that must be read()
+    virtual std::string_view mapped() { return std::string_view(); }
+};
+
+// PGN that is already in memory, e.g. one chunk of a larger file
+class memorySource : public pgnSource {
+ public:
+    explicit memorySource(std::string_view textInp) : text(textInp) {}
+    size_t read(char* buf, size_t size) override;
+    std::string_view mapped() override { return text; }
+
+ protected:
+    std::string_view text;
+    size_t offset = 0;
+};
+
+// a plain .pgn mapped into memory, so the reader can hand out views without copying
+class mmapSource : public memorySource {
+ public:
+    mmapSource(const char* data, size_t size) : memorySource(std::string_view(data, size)) {}
+    ~mmapSource() override;
+};
+
+class fileSource : public pgnSource {
+ public:
+    explicit fileSource(std::FILE* fileInp);
+    ~fileSource() override;
+    size_t read(char* buf, size_t size) override;
+    bool failed() const override { return std::ferror(file) != 0; }
+
+ private:
+    std::FILE* file;
+};
+
+// decompresses the .zst file as it is read. Only one compressed block is in memory at a time,
+// so a month of lichess games never has to be expanded on disk
+class zstdSource : public pgnSource {
+ public:
+    explicit zstdSource(std::FILE* fileInp);
+    ~zstdSource() override;
+    size_t read(char* buf, size_t size) override;
+    bool failed() const override { return error; }
+
+ private:
+    std::FILE* file;
+    ZSTD_DCtx* dctx;
+    std::vector<char> inBuf;
+    ZSTD_inBuffer in;
+    // the last call filled the output, so zstd may still be holding decompressed data
+    bool pendingOutput = false;
+    // what the last ZSTD_decompressStream returned, 0 when it finished a frame. The file may
+    // only end there, otherwise it was cut off (e.g. a partial download)
+    size_t frameRemaining = 0;
+    bool error = false;
+};
+
+// opens the file at path, decompressing it if it ends in .zst and mapping it otherwise.
+// Returns nullptr if it can't be opened
+std::unique_ptr<pgnSource> openPgnSource(const std::string& path);
@@ -0,0 +1,66 @@
+// Copyright Andrew Bernal 2023
+#include "positionAggregate.hpp"
+#include <string_view>
+#include <utility>
+
+namespace {
+void addResult(positionStats& stats, gameResult result) {
+    if (result == whiteWin) {
+        stats.whiteWins++;
+    } else if (result == blackWin) {
+        stats.blackWins++;
+    } else if (result == draw) {
+        stats.draws++;
+    }
+}
+
+void addStats(positionStats& into, const positionStats& from) {
+    into.whiteWins += from.whiteWins;
+    into.blackWins += from.blackWins;
+    into.draws += from.draws;
+}
+}  // namespace
+
+size_t positionAggregate::memoryBytes() const {
+    // one node per entry (plus the allocator's header), and a bucket pointer per entry
+    const size_t perPosition = sizeof(std::pair<const bucketedKey, positionStats>) + 16 +
+        sizeof(void*);
+    const size_t perMove = sizeof(std::pair<const moveEdge, positionStats>) + 16 +
+        sizeof(void*);
+    return positions.size() * perPosition + moves.size() * perMove;
+}
+
+void positionAggregate::clear() {
+    positions.clear();
+    moves.clear();
+}
+
+gameResult resultFromTag(std::string_view result) {
+    if (result == "1-0") {
+        return whiteWin;
+    } else if (result == "0-1") {
+        return blackWin;
+    } else if (result == "1/2-1/2") {
+        return draw;
+    }
+    return unknownResult;
+}
+
+void addPosition(positionAggregate& aggregate, const positionKey& key, gameBucket bucket,
+    gameResult result) {
+    addResult(aggregate.positions[bucketedKey{key, bucket}], result);
+}
+
+void addMove(positionAggregate& aggregate, int64_t parentKey, moveCode move, int64_t childKey,
+    gameBucket bucket, gameResult result) {
+    addResult(aggregate.moves[moveEdge{parentKey, childKey, move, bucket}], result);
+}
+
+void mergeAggregate(positionAggregate& into, const positionAggregate& from) {
+    for (const auto& [key, stats] : from.positions) {
+        addStats(into.positions[key], stats);
+    }
+    for (const auto& [edge, stats] : from.moves) {
+        addStats(into.moves[edge], stats);
+    }
+}
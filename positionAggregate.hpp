@@ -0,0 +1,83 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <cstdint>
+#include <string_view>
+#include <unordered_map>
+#include "gameBucket.hpp"
+#include "moveCode.hpp"
+#include "positionKey.hpp"
+
+enum gameResult : uint8_t { whiteWin, blackWin, draw, unknownResult };
+
+// "1-0" -> whiteWin. Unfinished games ("*") are unknownResult
+gameResult resultFromTag(std::string_view result);
+
+// the results of the games that reached a position, or that played a move. The most played
+// positions pass 2^31 games over a few years of lichess
+struct positionStats {
+    int64_t whiteWins = 0;
+    int64_t blackWins = 0;
+    int64_t draws = 0;
+    int64_t total() const { return whiteWins + blackWins + draws; }
+};
+
+// a position's games in one bucket. A row of lichess
+struct bucketedKey {
+    positionKey key;
+    gameBucket bucket;
+
+    bool operator==(const bucketedKey& other) const {
+        return bucket == other.bucket && key == other.key;
+    }
+};
+
+struct bucketedKeyHash {
+    size_t operator()(const bucketedKey& position) const {
+        return positionKeyHash()(position.key) ^ (size_t(position.bucket) << 56);
+    }
+};
+
+// a move from one position to another, by their database keys, in the games of one bucket.
+// A row of lichess_moves
+struct moveEdge {
+    int64_t parentKey;
+    int64_t childKey;
+    moveCode move;
+    gameBucket bucket;
+
+    bool operator==(const moveEdge& other) const {
+        return parentKey == other.parentKey && childKey == other.childKey &&
+            move == other.move && bucket == other.bucket;
+    }
+};
+
+struct moveEdgeHash {
+    size_t operator()(const moveEdge& edge) const {
+        // the keys are already hashes. Mixed unsigned, a signed overflow is undefined
+        return static_cast<uint64_t>(edge.parentKey) ^
+            (static_cast<uint64_t>(edge.childKey) * 31) ^ edge.move ^
+            (size_t(edge.bucket) << 56);
+    }
+};
+
+// the positions and moves seen in a run of games. Each is counted here however many times it
+// is played, and written to the database once per flush
+struct positionAggregate {
+    std::unordered_map<bucketedKey, positionStats, bucketedKeyHash> positions;
+    std::unordered_map<moveEdge, positionStats, moveEdgeHash> moves;
+
+    // rough size of the tables in memory, including the hash tables' own overhead
+    size_t memoryBytes() const;
+    void clear();
+};
+
+// counts the result of one game for the position
+void addPosition(positionAggregate& aggregate, const positionKey& key, gameBucket bucket,
+    gameResult result);
+
+// counts the result of one game for the move played from parentKey to childKey
+void addMove(positionAggregate& aggregate, int64_t parentKey, moveCode move, int64_t childKey,
+    gameBucket bucket, gameResult result);
+
+// adds the counts of from into into
+void mergeAggregate(positionAggregate& into, const positionAggregate& from);
@@ -0,0 +1,75 @@
+// Copyright Andrew Bernal 2023
+#include "positionKey.hpp"
+#include <string>
+
+namespace {
+// splitmix64 finalizer, spreads the few bits of side to move / castling / en passant
+uint64_t mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+}  // namespace
+
+positionKey makePositionKey(thc::ChessRules& position, bool canonical) {
+    positionKey key;
+    position.Compress(key.board);
+    // a double pawn push only matters if a pawn is there to take en passant
+    thc::Square enpassantTarget = canonical ? position.groomed_enpassant_target() :
+        position.enpassant_target;
+    // Hash64Calculate only looks at the squares. thc leaves a castling flag set after the rook
+    // is taken or moves away, the FEN (and the compressed board) only has the castling that is
+    // still allowed
+    uint64_t details = (position.white ? 1 : 0) | (position.wking_allowed() << 1) |
+        (position.wqueen_allowed() << 2) | (position.bking_allowed() << 3) |
+        (position.bqueen_allowed() << 4) |
+        (static_cast<uint64_t>(enpassantTarget) << 5);
+    key.hash = position.Hash64Calculate() ^ mix(details);
+    // the same position reached after a different number of moves is the same row
+    key.halfMoveClock = canonical ? 0 : static_cast<uint16_t>(position.half_move_clock);
+    key.fullMoveCount = canonical ? 1 : static_cast<uint16_t>(position.full_move_count);
+    key.enpassantTarget = static_cast<uint8_t>(enpassantTarget);
+    return key;
+}
+
+void positionFromKey(const positionKey& key, thc::ChessPosition& position) {
+    position.Decompress(key.board);
+    position.half_move_clock = key.halfMoveClock;
+    position.full_move_count = key.fullMoveCount;
+    position.enpassant_target = static_cast<thc::Square>(key.enpassantTarget);
+    // Decompress leaves the king squares alone, and move generation relies on them
+    for (int square = 0; square < 64; square++) {
+        if (position.squares[square] == 'K') {
+            position.wking_square = static_cast<thc::Square>(square);
+        } else if (position.squares[square] == 'k') {
+            position.bking_square = static_cast<thc::Square>(square);
+        }
+    }
+}
+
+std::string positionFen(const positionKey& key) {
+    thc::ChessPosition position;
+    positionFromKey(key, position);
+    return position.ForsythPublish();
+}
+
+int64_t databaseKey(const positionKey& key) {
+    uint64_t counters = key.halfMoveClock | (static_cast<uint64_t>(key.fullMoveCount) << 16);
+    // salted, so it can't cancel out the mix of the side to move / castling / en passant
+    return static_cast<int64_t>(key.hash ^ mix(counters ^ 0x5bd1e995ULL << 32));
+}
+
+std::string boardBytea(const positionKey& key) {
+    return boardBytea(reinterpret_cast<const uint8_t*>(key.board.storage));
+}
+
+std::string boardBytea(const uint8_t* board) {
+    static const char digits[] = "0123456789abcdef";
+    std::string bytea = "\\x";
+    for (size_t i = 0; i < sizeof(thc::CompressedPosition::storage); i++) {
+        bytea += digits[board[i] >> 4];
+        bytea += digits[board[i] & 0xf];
+    }
+    return bytea;
+}
@@ -0,0 +1,50 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include "thc.h"
+
+// a position as the lichess table stores it, without going through a FEN string.
+// board is thc's exact 24 byte encoding (pieces, side to move, castling, and en passant if it
+// can be captured). The stored FEN also has the move counters and the en passant square after
+// every double pawn push, so they are kept alongside it
+struct positionKey {
+    // thc's 64-bit hash of the squares, mixed with the rest of the position
+    uint64_t hash;
+    thc::CompressedPosition board;
+    uint16_t halfMoveClock;
+    uint16_t fullMoveCount;
+    uint8_t enpassantTarget;
+
+    bool operator==(const positionKey& other) const {
+        return hash == other.hash && halfMoveClock == other.halfMoveClock &&
+            fullMoveCount == other.fullMoveCount && enpassantTarget == other.enpassantTarget &&
+            std::memcmp(board.storage, other.board.storage, sizeof(board.storage)) == 0;
+    }
+};
+
+struct positionKeyHash {
+    size_t operator()(const positionKey& key) const { return key.hash; }
+};
+
+// A canonical key is only the board, side to move, castling rights, and the en passant square
+// if a pawn can take it, so transpositions get the same key. Otherwise the key is everything in
+// the FEN, move counters included
+positionKey makePositionKey(thc::ChessRules& position, bool canonical);
+
+// sets up position from the key, including the move counters
+void positionFromKey(const positionKey& key, thc::ChessPosition& position);
+
+// the FEN of the position, for the optional fen column
+std::string positionFen(const positionKey& key);
+
+// the position_key column: a 64-bit hash of everything in the key, so the move counters are
+// mixed in too (they are constant in a canonical key). Positions that share it are told apart
+// by the board column
+int64_t databaseKey(const positionKey& key);
+
+// the board column, as a hex bytea literal ("\\x..."). Works as a COPY value and a parameter
+std::string boardBytea(const positionKey& key);
+// the same for the 24 bytes of a board on their own, e.g. from an opening book
+std::string boardBytea(const uint8_t* board);
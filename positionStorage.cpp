@@ -0,0 +1,67 @@
+// Copyright Andrew Bernal 2023
+#include "positionStorage.hpp"
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "bookStorage.hpp"
+#include "lsmStorage.hpp"
+#include "memoryStorage.hpp"
+#include "postgresStorage.hpp"
+#include "sqliteStorage.hpp"
+
+positionStorage::positionStorage(bool canonicalInp, const std::vector<gameBucket>& bucketsInp)
+    : canonicalKeys(canonicalInp), buckets(bucketsInp) {
+    for (gameBucket bucket : buckets) {
+        wantedBuckets.set(bucket);
+    }
+    if (buckets.empty()) {
+        wantedBuckets.set();
+    }
+}
+
+std::string positionStorage::bucketFilter() const {
+    std::string filter;
+    for (gameBucket bucket : buckets) {
+        filter += (filter.empty() ? " AND bucket IN (" : ", ") + std::to_string(bucket);
+    }
+    return filter.empty() ? filter : filter + ")";
+}
+
+std::vector<std::optional<positionStats>> positionStorage::getPositions(
+    const std::vector<positionKey>& keys) {
+    std::vector<std::optional<positionStats>> found(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        positionStats stats;
+        if (getPosition(keys[i], stats)) {
+            found[i] = stats;
+        }
+    }
+    return found;
+}
+
+std::vector<std::vector<storedMove>> positionStorage::getChildLists(
+    const std::vector<int64_t>& parentKeys) {
+    std::vector<std::vector<storedMove>> lists;
+    for (int64_t parentKey : parentKeys) {
+        lists.push_back(getChildren(parentKey));
+    }
+    return lists;
+}
+
+std::unique_ptr<positionStorage> openStorage(const storageOptions& options) {
+    if (options.kind == "postgres") {
+        return openPostgresStorage(options);
+    } else if (options.kind == "sqlite") {
+        return openSqliteStorage(options);
+    } else if (options.kind == "lsm") {
+        return openLsmStorage(options);
+    } else if (options.kind == "memory") {
+        return std::make_unique<memoryStorage>(options.canonical, options.buckets);
+    } else if (options.kind == "book") {
+        return openBookStorage(options);
+    }
+    std::cerr << "Unknown storage " << options.kind << std::endl;
+    return nullptr;
+}
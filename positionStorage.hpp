@@ -0,0 +1,125 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <bitset>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "gameBucket.hpp"
+#include "moveCode.hpp"
+#include "openingBook.hpp"
+#include "positionAggregate.hpp"
+#include "positionKey.hpp"
+
+// how far the ingest of one PGN file has got. It is saved with each flush, so after a crash
+// everything before byteOffset is stored and nothing after it
+struct ingestCheckpoint {
+    // bytes of (decompressed) PGN whose games have been written
+    uint64_t byteOffset = 0;
+    int64_t games = 0;
+    // size of the post-processed file at that point
+    uint64_t postBytes = 0;
+};
+
+// a move out of a position, with its counts summed over the buckets that were asked for
+struct storedMove {
+    moveCode move;
+    int64_t childKey;
+    positionStats stats;
+};
+
+// what prune took out of the hot tables
+struct pruneResult {
+    uint64_t positions = 0;
+    uint64_t moves = 0;
+};
+
+// everything from configuration.txt that picks and sets up a storage
+struct storageOptions {
+    // postgres, sqlite, lsm, memory or book
+    std::string kind = "postgres";
+    std::string databaseConnectionString;
+    std::string sqliteLocation;
+    // the directory of the lsm store
+    std::string lsmLocation;
+    std::string openingBookLocation;
+    // the keys are made with canonicalPositions
+    bool canonical = false;
+    // reads only add up the games of these buckets. Empty is every bucket
+    std::vector<gameBucket> buckets;
+    // the parser is writing. Otherwise the storage is only read, and left as it is
+    bool ingest = false;
+    // the file being ingested, the checkpoints are kept per file
+    std::string source;
+    // postgres only: load into an empty table and build the indexes at the end
+    bool initialLoad = false;
+    bool resume = false;
+    // postgres only: fill in the fen column
+    bool storeFen = false;
+    // postgres only: --prune rewrites the tables with VACUUM FULL, so the files shrink
+    bool vacuumFull = false;
+};
+
+// where the positions and their moves are kept. The parser only flushes into it and the
+// repertoireBuilder only reads from it, so each deployment can pick the engine that suits it:
+// postgres for a shared server, sqlite for one machine, lsm for ingests bigger than memory,
+// memory for tests and benchmarks, and the opening book when nothing needs to be written
+class positionStorage {
+ public:
+    explicit positionStorage(bool canonicalInp, const std::vector<gameBucket>& bucketsInp = {});
+    virtual ~positionStorage() = default;
+
+    // whether keys for this storage are made canonical. A book records its own
+    bool canonical() const { return canonicalKeys; }
+    // false for storages that can't be ingested into
+    virtual bool writable() const { return true; }
+
+    // adds the counts of the positions and moves, and saves the checkpoint with them
+    virtual void flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint) = 0;
+    // called once after the last flush of an ingest
+    virtual void finish() {}
+    // the checkpoint of the last flush of the source. False if there isn't one
+    virtual bool loadCheckpoint(ingestCheckpoint& checkpoint) = 0;
+
+    // the counts of a position, summed over the buckets that were asked for. False if it isn't
+    // stored
+    virtual bool getPosition(const positionKey& key, positionStats& stats) = 0;
+    // the counts of many positions at once, in the order of keys. Storages where a lookup is a
+    // round trip override this to do them all in one
+    virtual std::vector<std::optional<positionStats>> getPositions(
+        const std::vector<positionKey>& keys);
+    // every move played from the position with this database key
+    virtual std::vector<storedMove> getChildren(int64_t parentKey) = 0;
+    // the moves of many positions at once, in the order of parentKeys. Like getPositions, for
+    // storages where a lookup is a round trip
+    virtual std::vector<std::vector<storedMove>> getChildLists(
+        const std::vector<int64_t>& parentKeys);
+
+    // removes every position and move played in fewer than minGames games, over all buckets.
+    // With keepCold they are moved to cold tables that nothing reads, instead of being
+    // deleted. A move is never played more often than the positions on either side of it, so
+    // the moves into and out of a pruned position are always pruned with it. Pruned counts
+    // start again from zero if more games are loaded, so prune after the last ingest
+    virtual pruneResult prune(int minGames, bool keepCold) = 0;
+    // adds a month that was ingested on its own (./parser --delta) and records that it was
+    // applied, in one step. The delta is sorted, so merging it costs time in proportion to
+    // the month rather than to everything stored. False, changing nothing, if the month was
+    // already applied
+    virtual bool applyDelta(const openingBook& delta, const std::string& month) = 0;
+
+ protected:
+    // whether reads count the games of bucket
+    bool wanted(gameBucket bucket) const { return wantedBuckets.test(bucket); }
+    // " AND bucket IN (...)" for the sql backends, empty if every bucket is wanted
+    std::string bucketFilter() const;
+
+    bool canonicalKeys;
+    // the buckets asked for, empty for all of them
+    std::vector<gameBucket> buckets;
+    // the same as a set, with every bucket in it if none were asked for
+    std::bitset<bucketCount> wantedBuckets;
+};
+
+// opens the storage options.kind names. Null, after printing why, if it can't be opened
+std::unique_ptr<positionStorage> openStorage(const storageOptions& options);
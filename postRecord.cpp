@@ -0,0 +1,81 @@
+// Copyright Andrew Bernal 2023
+#include "postRecord.hpp"
+#include <cstring>
+#include <string>
+
+namespace {
+template <typename T>
+void put(char*& out, T value) {
+    std::memcpy(out, &value, sizeof(value));
+    out += sizeof(value);
+}
+
+template <typename T>
+T get(const char*& in) {
+    T value;
+    std::memcpy(&value, in, sizeof(value));
+    in += sizeof(value);
+    return value;
+}
+}  // namespace
+
+void appendPostRecord(std::string& out, const postRecord& record) {
+    char bytes[postRecordSize];
+    char* p = bytes;
+    put(p, record.key.hash);
+    std::memcpy(p, record.key.board.storage, sizeof(record.key.board.storage));
+    p += sizeof(record.key.board.storage);
+    put(p, record.key.halfMoveClock);
+    put(p, record.key.fullMoveCount);
+    put(p, record.key.enpassantTarget);
+    put(p, record.move);
+    put(p, static_cast<uint8_t>(record.result | static_cast<uint8_t>(record.speed) << 4));
+    put(p, record.ratingSum);
+    out.append(bytes, postRecordSize);
+}
+
+postReader::postReader(std::FILE* fileInp) : file(fileInp), buffer(postRecordSize << 16) {
+    char magic[sizeof(postFileMagic)];
+    validFile = std::fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+        std::memcmp(magic, postFileMagic, sizeof(magic)) == 0;
+    offset = sizeof(magic);
+}
+
+postReader::~postReader() {
+    std::fclose(file);
+}
+
+bool postReader::next(postRecord& record) {
+    if (size - position < postRecordSize) {
+        // keep a partial record at the end of the buffer
+        size_t left = size - position;
+        std::memmove(buffer.data(), buffer.data() + position, left);
+        size = left + std::fread(buffer.data() + left, 1, buffer.size() - left, file);
+        position = 0;
+        if (size < postRecordSize) {
+            return false;
+        }
+    }
+    const char* p = buffer.data() + position;
+    record.key.hash = get<uint64_t>(p);
+    std::memcpy(record.key.board.storage, p, sizeof(record.key.board.storage));
+    p += sizeof(record.key.board.storage);
+    record.key.halfMoveClock = get<uint16_t>(p);
+    record.key.fullMoveCount = get<uint16_t>(p);
+    record.key.enpassantTarget = get<uint8_t>(p);
+    record.move = get<moveCode>(p);
+    uint8_t resultAndSpeed = get<uint8_t>(p);
+    record.result = static_cast<gameResult>(resultAndSpeed & 0xf);
+    record.speed = static_cast<gameSpeed>(resultAndSpeed >> 4);
+    record.ratingSum = get<uint16_t>(p);
+    position += postRecordSize;
+    offset += postRecordSize;
+    return true;
+}
+
+void postReader::seek(uint64_t offsetInp) {
+    std::fseek(file, offsetInp, SEEK_SET);
+    offset = offsetInp;
+    position = 0;
+    size = 0;
+}
@@ -0,0 +1,52 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "moveCode.hpp"
+#include "positionAggregate.hpp"
+#include "positionKey.hpp"
+
+// one half-move of the post-processed file. The file starts with postFileMagic, then fixed
+// size little-endian records: key hash (8), compressed board (24), halfmove clock (2),
+// fullmove number (2), en passant square (1), move (2), result and speed (1, the speed in the
+// high 4 bits), rating sum (2).
+// Nothing in it needs FEN or SAN parsing to be loaded back into the database
+struct postRecord {
+    positionKey key;
+    moveCode move;
+    gameResult result;
+    gameSpeed speed;
+    // white's plus black's rating, so the average can be filtered exactly
+    uint16_t ratingSum;
+};
+
+constexpr char postFileMagic[8] = {'R', 'B', 'P', 'O', 'S', 'T', '2', '\n'};
+constexpr size_t postRecordSize = 42;
+
+void appendPostRecord(std::string& out, const postRecord& record);
+
+// reads the records back in large blocks
+class postReader {
+ public:
+    explicit postReader(std::FILE* fileInp);
+    ~postReader();
+    // false if the file doesn't start with postFileMagic
+    bool valid() const { return validFile; }
+    // false at the end of the file
+    bool next(postRecord& record);
+    // skips to a byte offset of the file, e.g. a checkpoint
+    void seek(uint64_t offset);
+    // bytes of the file read so far, including the magic. Safe to call from other threads
+    uint64_t bytesRead() const { return offset.load(std::memory_order_relaxed); }
+
+ private:
+    std::FILE* file;
+    bool validFile;
+    std::vector<char> buffer;
+    size_t position = 0;
+    size_t size = 0;
+    std::atomic<uint64_t> offset{0};
+};
@@ -0,0 +1,240 @@
+// Copyright Andrew Bernal 2023
+#include "postgresLoader.hpp"
+#include <iostream>
+#include <initializer_list>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <tuple>
+#include <vector>
+
+namespace {
+pqxx::stream_to openStream(pqxx::work& txn, const std::string& table,
+    std::initializer_list<std::string_view> columns) {
+#if PQXX_VERSION_MAJOR > 7 || (PQXX_VERSION_MAJOR == 7 && PQXX_VERSION_MINOR >= 5)
+    return pqxx::stream_to::table(txn, {table}, columns);
+#else
+    return pqxx::stream_to(txn, table, std::vector<std::string>(columns.begin(), columns.end()));
+#endif
+}
+}  // namespace
+
+postgresLoader::postgresLoader(pqxx::connection& connInp, const std::string& sourceInp,
+    bool initialLoadInp, bool resume, bool storeFenInp, bool canonicalInp)
+    : conn(connInp), source(sourceInp), initialLoad(initialLoadInp), storeFen(storeFenInp),
+    canonical(canonicalInp) {
+    pqxx::work txn(conn);
+    if (!(initialLoad && resume)) {
+        // recreated rather than truncated, in case they were made for an older layout
+        txn.exec0("DROP TABLE IF EXISTS lichess_staging, lichess_moves_staging");
+    }
+    // the staging table is scratch space, so it skips the WAL.
+    // An UNLOGGED table is emptied by a crash, an interrupted initial load can't be resumed then
+    txn.exec0("CREATE UNLOGGED TABLE IF NOT EXISTS lichess_staging ("
+        "position_key BIGINT NOT NULL, board BYTEA NOT NULL, bucket SMALLINT NOT NULL, fen TEXT, "
+        "white_wins BIGINT NOT NULL, black_wins BIGINT NOT NULL, draws BIGINT NOT NULL)");
+    txn.exec0("CREATE UNLOGGED TABLE IF NOT EXISTS lichess_moves_staging ("
+        "parent_key BIGINT NOT NULL, move_code SMALLINT NOT NULL, child_key BIGINT NOT NULL, "
+        "bucket SMALLINT NOT NULL, white_wins BIGINT NOT NULL, black_wins BIGINT NOT NULL, "
+        "draws BIGINT NOT NULL)");
+    txn.exec0("CREATE TABLE IF NOT EXISTS ingest_checkpoint (source TEXT PRIMARY KEY, "
+        "byte_offset BIGINT NOT NULL, games BIGINT NOT NULL, post_bytes BIGINT NOT NULL)");
+    // one row at most
+    txn.exec0("CREATE TABLE IF NOT EXISTS lichess_metadata ("
+        "id BOOLEAN PRIMARY KEY DEFAULT true CHECK (id), canonical BOOLEAN NOT NULL)");
+    if (initialLoad) {
+        // the indexes are built once in finish()
+        // (lichess_position_key_index is the old index on position_key alone)
+        txn.exec0("DROP INDEX IF EXISTS lichess_position_key_index, lichess_position_index");
+        txn.exec0("ALTER TABLE lichess_moves DROP CONSTRAINT IF EXISTS lichess_moves_pkey");
+    }
+    txn.commit();
+}
+
+void postgresLoader::flush(const positionAggregate& aggregate,
+    const ingestCheckpoint& checkpoint) {
+    pqxx::work txn(conn);
+    {
+        pqxx::stream_to stream = openStream(txn, "lichess_staging", {"position_key", "board",
+            "bucket", "fen", "white_wins", "black_wins", "draws"});
+        std::optional<std::string> fen;
+        for (const auto& [position, stats] : aggregate.positions) {
+            if (storeFen) {
+                fen = positionFen(position.key);
+            }
+            stream << std::make_tuple(databaseKey(position.key), boardBytea(position.key),
+                static_cast<int16_t>(position.bucket), fen, stats.whiteWins, stats.blackWins,
+                stats.draws);
+        }
+        stream.complete();
+    }
+    {
+        pqxx::stream_to stream = openStream(txn, "lichess_moves_staging", {"parent_key",
+            "move_code", "child_key", "bucket", "white_wins", "black_wins", "draws"});
+        for (const auto& [edge, stats] : aggregate.moves) {
+            stream << std::make_tuple(edge.parentKey, static_cast<int16_t>(edge.move),
+                edge.childKey, static_cast<int16_t>(edge.bucket), stats.whiteWins,
+                stats.blackWins, stats.draws);
+        }
+        stream.complete();
+    }
+    if (!initialLoad) {
+        mergeStaged(txn);
+    }
+    recordCanonical(txn);
+    txn.exec_params(
+        "INSERT INTO ingest_checkpoint (source, byte_offset, games, post_bytes) "
+        "VALUES ($1, $2, $3, $4) ON CONFLICT (source) DO UPDATE SET "
+        "byte_offset = EXCLUDED.byte_offset, games = EXCLUDED.games, "
+        "post_bytes = EXCLUDED.post_bytes",
+        source, static_cast<int64_t>(checkpoint.byteOffset), checkpoint.games,
+        static_cast<int64_t>(checkpoint.postBytes));
+    txn.commit();
+}
+
+void postgresLoader::mergeStaged(pqxx::work& txn) {
+    // the staged rows are unique by position and bucket, and so is lichess_position_index.
+    // When two ingests (or an ingest and --apply-delta) add the same new position, the second
+    // waits for the first to commit and then adds to its row instead of inserting another
+    txn.exec0(
+        "INSERT INTO lichess "
+        "(position_key, board, bucket, fen, white_wins, black_wins, draws) "
+        "SELECT position_key, board, bucket, fen, white_wins, black_wins, draws "
+        "FROM lichess_staging ON CONFLICT (position_key, board, bucket) "
+        "DO UPDATE SET white_wins = lichess.white_wins + EXCLUDED.white_wins, "
+        "black_wins = lichess.black_wins + EXCLUDED.black_wins, "
+        "draws = lichess.draws + EXCLUDED.draws");
+    // and the moves on their primary key
+    txn.exec0(
+        "INSERT INTO lichess_moves "
+        "(parent_key, move_code, child_key, bucket, white_wins, black_wins, draws) "
+        "SELECT parent_key, move_code, child_key, bucket, white_wins, black_wins, draws "
+        "FROM lichess_moves_staging ON CONFLICT (parent_key, move_code, child_key, bucket) "
+        "DO UPDATE SET white_wins = lichess_moves.white_wins + EXCLUDED.white_wins, "
+        "black_wins = lichess_moves.black_wins + EXCLUDED.black_wins, "
+        "draws = lichess_moves.draws + EXCLUDED.draws");
+    txn.exec0("TRUNCATE lichess_staging, lichess_moves_staging");
+}
+
+void postgresLoader::recordCanonical(pqxx::work& txn) {
+    txn.exec_params("INSERT INTO lichess_metadata (canonical) VALUES ($1) "
+        "ON CONFLICT (id) DO NOTHING", canonical);
+}
+
+bool postgresLoader::applyDelta(const openingBook& delta, const std::string& month) {
+    pqxx::work txn(conn);
+    txn.exec0("CREATE TABLE IF NOT EXISTS lichess_applied_months (month TEXT PRIMARY KEY, "
+        "applied_at TIMESTAMPTZ NOT NULL DEFAULT now(), positions BIGINT NOT NULL, "
+        "moves BIGINT NOT NULL)");
+    // the month is claimed first, in the same transaction as its rows, so it can't be counted
+    // twice even by two runs at once
+    if (txn.exec_params("INSERT INTO lichess_applied_months (month, positions, moves) "
+        "VALUES ($1, $2, $3) ON CONFLICT (month) DO NOTHING", month,
+        static_cast<int64_t>(delta.positionCount()),
+        static_cast<int64_t>(delta.moveCount())).affected_rows() == 0) {
+        return false;
+    }
+    {
+        pqxx::stream_to stream = openStream(txn, "lichess_staging", {"position_key", "board",
+            "bucket", "white_wins", "black_wins", "draws"});
+        const bookPosition* positions = delta.positionData();
+        for (uint64_t i = 0; i < delta.positionCount(); i++) {
+            const bookPosition& position = positions[i];
+            stream << std::make_tuple(position.key, boardBytea(position.board),
+                static_cast<int16_t>(position.bucket), position.whiteWins, position.blackWins,
+                position.draws);
+        }
+        stream.complete();
+    }
+    {
+        pqxx::stream_to stream = openStream(txn, "lichess_moves_staging", {"parent_key",
+            "move_code", "child_key", "bucket", "white_wins", "black_wins", "draws"});
+        const bookMove* moves = delta.moveData();
+        for (uint64_t i = 0; i < delta.moveCount(); i++) {
+            const bookMove& edge = moves[i];
+            stream << std::make_tuple(edge.parentKey, static_cast<int16_t>(edge.move),
+                edge.childKey, static_cast<int16_t>(edge.bucket), edge.whiteWins,
+                edge.blackWins, edge.draws);
+        }
+        stream.complete();
+    }
+    // the staged month is sorted and can be millions of rows. With fresh statistics the
+    // planner joins it against the index in one pass instead of guessing it is tiny
+    txn.exec0("ANALYZE lichess_staging, lichess_moves_staging");
+    mergeStaged(txn);
+    recordCanonical(txn);
+    txn.commit();
+    return true;
+}
+
+void postgresLoader::finish() {
+    if (!initialLoad) {
+        return;
+    }
+    std::cerr << "Merging the staged positions and building the indexes\n";
+    pqxx::work txn(conn);
+    // a position or move can be staged once per flush, so sum them up here
+    txn.exec0(
+        "INSERT INTO lichess (position_key, board, bucket, fen, white_wins, black_wins, draws) "
+        "SELECT position_key, board, bucket, MAX(fen), SUM(white_wins), SUM(black_wins), "
+        "SUM(draws) FROM lichess_staging GROUP BY position_key, board, bucket");
+    txn.exec0(
+        "INSERT INTO lichess_moves "
+        "(parent_key, move_code, child_key, bucket, white_wins, black_wins, draws) "
+        "SELECT parent_key, move_code, child_key, bucket, SUM(white_wins), SUM(black_wins), "
+        "SUM(draws) FROM lichess_moves_staging GROUP BY parent_key, move_code, child_key, bucket");
+    txn.exec0("CREATE UNIQUE INDEX lichess_position_index ON lichess "
+        "(position_key, board, bucket)");
+    txn.exec0("ALTER TABLE lichess_moves ADD CONSTRAINT lichess_moves_pkey "
+        "PRIMARY KEY (parent_key, move_code, child_key, bucket)");
+    txn.exec0("TRUNCATE lichess_staging, lichess_moves_staging");
+    txn.commit();
+}
+
+bool postgresLoader::hasStagedRows() {
+    pqxx::work txn(conn);
+    pqxx::result result = txn.exec("SELECT EXISTS (SELECT 1 FROM lichess_staging)");
+    return result[0][0].as<bool>();
+}
+
+bool lichessIsEmpty(pqxx::connection& conn) {
+    pqxx::work txn(conn);
+    pqxx::result result = txn.exec("SELECT NOT EXISTS (SELECT 1 FROM lichess)");
+    return result[0][0].as<bool>();
+}
+
+bool hasIndexes(pqxx::connection& conn) {
+    pqxx::work txn(conn);
+    pqxx::result result = txn.exec(
+        "SELECT to_regclass('lichess_position_index') IS NOT NULL AND EXISTS (SELECT 1 FROM "
+        "pg_constraint WHERE conname = 'lichess_moves_pkey' AND "
+        "conrelid = 'lichess_moves'::regclass)");
+    return result[0][0].as<bool>();
+}
+
+std::optional<bool> storedCanonical(pqxx::connection& conn) {
+    pqxx::work txn(conn);
+    // the table is only made by a loader, a reader mustn't fail without it
+    if (txn.exec("SELECT to_regclass('lichess_metadata')")[0][0].is_null()) {
+        return std::nullopt;
+    }
+    pqxx::result result = txn.exec("SELECT canonical FROM lichess_metadata");
+    if (result.size() == 0) {
+        return std::nullopt;
+    }
+    return result[0][0].as<bool>();
+}
+
+bool loadCheckpoint(pqxx::connection& conn, const std::string& source,
+    ingestCheckpoint& checkpoint) {
+    pqxx::work txn(conn);
+    pqxx::result result = txn.exec_params(
+        "SELECT byte_offset, games, post_bytes FROM ingest_checkpoint WHERE source = $1", source);
+    if (result.size() == 0) {
+        return false;
+    }
+    checkpoint.byteOffset = result[0][0].as<int64_t>();
+    checkpoint.games = result[0][1].as<int64_t>();
+    checkpoint.postBytes = result[0][2].as<int64_t>();
+    return true;
+}
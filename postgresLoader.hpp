@@ -0,0 +1,60 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <pqxx/pqxx>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include "openingBook.hpp"
+#include "positionAggregate.hpp"
+#include "positionStorage.hpp"
+
+// writes aggregated positions to the lichess table, and their moves to lichess_moves, with COPY
+// instead of INSERTs.
+// Every flush is streamed into UNLOGGED staging tables and merged with set-based statements.
+// For an initial load into an empty table the staged rows are only merged at the end,
+// and the indexes are built once after the merge instead of row by row
+class postgresLoader {
+ public:
+    // resuming keeps what an interrupted initial load already staged.
+    // The fen column is left NULL unless storeFen is set. canonical is how the keys are made,
+    // the first flush records it in lichess_metadata
+    postgresLoader(pqxx::connection& connInp, const std::string& sourceInp, bool initialLoadInp,
+        bool resume, bool storeFenInp, bool canonicalInp);
+    // writes the aggregate and the checkpoint for the source in one transaction
+    void flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint);
+    // merges what an initial load staged and rebuilds the index. Nothing to do otherwise
+    void finish();
+    // false if the staging table is empty, e.g. after postgres truncated it in crash recovery
+    bool hasStagedRows();
+    // stages the delta and merges it like a flush, and records the month in
+    // lichess_applied_months, all in one transaction. False if the month was already applied
+    bool applyDelta(const openingBook& delta, const std::string& month);
+
+ private:
+    // adds the staged rows to the tables, and empties the staging tables
+    void mergeStaged(pqxx::work& txn);
+    // records canonical in lichess_metadata, unless something already is
+    void recordCanonical(pqxx::work& txn);
+
+    pqxx::connection& conn;
+    // the PGN file being ingested, the checkpoints are kept per file
+    std::string source;
+    bool initialLoad;
+    bool storeFen;
+    bool canonical;
+};
+
+// the last checkpoint saved for the source. False if there isn't one
+bool loadCheckpoint(pqxx::connection& conn, const std::string& source,
+    ingestCheckpoint& checkpoint);
+
+// true if the lichess table has no rows, so an initial load is safe
+bool lichessIsEmpty(pqxx::connection& conn);
+
+// false if lichess_position_index or lichess_moves_pkey is missing, which is how an initial
+// load that never got to finish() leaves the tables
+bool hasIndexes(pqxx::connection& conn);
+
+// the canonicalPositions the tables were loaded with, from lichess_metadata. Empty if nothing
+// has been loaded yet, or the database is older than the table
+std::optional<bool> storedCanonical(pqxx::connection& conn);
@@ -0,0 +1,211 @@
+// Copyright Andrew Bernal 2023
+#include "postgresStorage.hpp"
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+postgresStorage::postgresStorage(const storageOptions& options)
+    : positionStorage(options.canonical, options.buckets), conn(options.databaseConnectionString),
+    source(options.source), vacuumFull(options.vacuumFull) {}
+
+void postgresStorage::flush(const positionAggregate& aggregate,
+    const ingestCheckpoint& checkpoint) {
+    loader->flush(aggregate, checkpoint);
+}
+
+void postgresStorage::finish() {
+    loader->finish();
+}
+
+bool postgresStorage::loadCheckpoint(ingestCheckpoint& checkpoint) {
+    return ::loadCheckpoint(conn, source, checkpoint);
+}
+
+bool postgresStorage::getPosition(const positionKey& key, positionStats& stats) {
+    // rows are found by their 64-bit key, and the board tells apart positions that share one.
+    // A position has a row per bucket, the ones that were asked for are summed
+    pqxx::nontransaction txn(conn);
+    // the sums over bigint columns are numeric, they are read back as bigint
+    pqxx::result result = txn.exec_params("SELECT SUM(white_wins)::bigint, "
+        "SUM(black_wins)::bigint, SUM(draws)::bigint FROM lichess "
+        "WHERE position_key = $1 AND board = $2" + bucketFilter() +
+        " GROUP BY position_key", databaseKey(key), boardBytea(key));
+    if (result.size() == 0) {
+        return false;
+    }
+    stats = {result[0][0].as<int64_t>(), result[0][1].as<int64_t>(),
+        result[0][2].as<int64_t>()};
+    return true;
+}
+
+std::vector<std::optional<positionStats>> postgresStorage::getPositions(
+    const std::vector<positionKey>& keys) {
+    std::vector<std::optional<positionStats>> found(keys.size());
+    if (keys.empty()) {
+        return found;
+    }
+    // the keys go in as one array literal, and the rows are matched back to them by key and board
+    std::unordered_map<int64_t, std::vector<size_t>> wanted;
+    std::string keyArray = "{";
+    for (size_t i = 0; i < keys.size(); i++) {
+        int64_t key = databaseKey(keys[i]);
+        wanted[key].push_back(i);
+        keyArray += (i ? "," : "") + std::to_string(key);
+    }
+    keyArray += "}";
+
+    pqxx::nontransaction txn(conn);
+    pqxx::result result = txn.exec_params("SELECT position_key, encode(board, 'hex'), "
+        "SUM(white_wins)::bigint, SUM(black_wins)::bigint, SUM(draws)::bigint FROM lichess "
+        "WHERE position_key = ANY($1::bigint[])" + bucketFilter() +
+        " GROUP BY position_key, board", keyArray);
+    for (size_t row = 0; row < result.size(); row++) {
+        std::string board = "\\x" + result[row][1].as<std::string>();
+        for (size_t i : wanted[result[row][0].as<int64_t>()]) {
+            if (boardBytea(keys[i]) == board) {
+                found[i] = positionStats{result[row][2].as<int64_t>(),
+                    result[row][3].as<int64_t>(), result[row][4].as<int64_t>()};
+            }
+        }
+    }
+    return found;
+}
+
+std::vector<storedMove> postgresStorage::getChildren(int64_t parentKey) {
+    // one range scan of the primary key
+    pqxx::nontransaction txn(conn);
+    pqxx::result result = txn.exec_params("SELECT move_code, child_key, "
+        "SUM(white_wins)::bigint, SUM(black_wins)::bigint, SUM(draws)::bigint "
+        "FROM lichess_moves WHERE parent_key = $1" + bucketFilter() +
+        " GROUP BY move_code, child_key", parentKey);
+    std::vector<storedMove> children;
+    for (size_t i = 0; i < result.size(); i++) {
+        children.push_back({static_cast<moveCode>(result[i][0].as<int>()),
+            result[i][1].as<int64_t>(),
+            {result[i][2].as<int64_t>(), result[i][3].as<int64_t>(),
+                result[i][4].as<int64_t>()}});
+    }
+    return children;
+}
+
+std::vector<std::vector<storedMove>> postgresStorage::getChildLists(
+    const std::vector<int64_t>& parentKeys) {
+    std::vector<std::vector<storedMove>> lists(parentKeys.size());
+    if (parentKeys.empty()) {
+        return lists;
+    }
+    // the same parent can be asked for twice, e.g. after a transposition
+    std::unordered_map<int64_t, std::vector<size_t>> wanted;
+    std::string keyArray = "{";
+    for (size_t i = 0; i < parentKeys.size(); i++) {
+        wanted[parentKeys[i]].push_back(i);
+        keyArray += (i ? "," : "") + std::to_string(parentKeys[i]);
+    }
+    keyArray += "}";
+
+    pqxx::nontransaction txn(conn);
+    pqxx::result result = txn.exec_params("SELECT parent_key, move_code, child_key, "
+        "SUM(white_wins)::bigint, SUM(black_wins)::bigint, SUM(draws)::bigint FROM lichess_moves "
+        "WHERE parent_key = ANY($1::bigint[])" + bucketFilter() +
+        " GROUP BY parent_key, move_code, child_key", keyArray);
+    for (size_t row = 0; row < result.size(); row++) {
+        storedMove child = {static_cast<moveCode>(result[row][1].as<int>()),
+            result[row][2].as<int64_t>(),
+            {result[row][3].as<int64_t>(), result[row][4].as<int64_t>(),
+                result[row][5].as<int64_t>()}};
+        for (size_t i : wanted[result[row][0].as<int64_t>()]) {
+            lists[i].push_back(child);
+        }
+    }
+    return lists;
+}
+
+pruneResult postgresStorage::prune(int minGames, bool keepCold) {
+    // a position or move is kept if its games over every bucket reach minGames
+    std::string floor = std::to_string(minGames);
+    std::string positionsWhere = " WHERE (position_key, board) IN (SELECT position_key, board "
+        "FROM lichess GROUP BY position_key, board "
+        "HAVING SUM(white_wins + black_wins + draws) < " + floor + ")";
+    std::string movesWhere = " WHERE (parent_key, move_code, child_key) IN (SELECT parent_key, "
+        "move_code, child_key FROM lichess_moves GROUP BY parent_key, move_code, child_key "
+        "HAVING SUM(white_wins + black_wins + draws) < " + floor + ")";
+    pruneResult pruned;
+    {
+        pqxx::work txn(conn);
+        txn.exec0("CREATE TABLE IF NOT EXISTS lichess_prune_log (pruned_at TIMESTAMPTZ NOT NULL "
+            "DEFAULT now(), min_games INTEGER NOT NULL, cold BOOLEAN NOT NULL, "
+            "positions BIGINT NOT NULL, moves BIGINT NOT NULL)");
+        if (keepCold) {
+            txn.exec0("CREATE TABLE IF NOT EXISTS lichess_cold (LIKE lichess)");
+            txn.exec0("CREATE TABLE IF NOT EXISTS lichess_moves_cold (LIKE lichess_moves)");
+            pruned.positions = txn.exec("WITH pruned AS (DELETE FROM lichess" +
+                positionsWhere + " RETURNING *) INSERT INTO lichess_cold SELECT * FROM pruned")
+                .affected_rows();
+            pruned.moves = txn.exec("WITH pruned AS (DELETE FROM lichess_moves" + movesWhere +
+                " RETURNING *) INSERT INTO lichess_moves_cold SELECT * FROM pruned")
+                .affected_rows();
+        } else {
+            pruned.positions = txn.exec("DELETE FROM lichess" + positionsWhere).affected_rows();
+            pruned.moves = txn.exec("DELETE FROM lichess_moves" + movesWhere).affected_rows();
+        }
+        txn.exec_params("INSERT INTO lichess_prune_log (min_games, cold, positions, moves) "
+            "VALUES ($1, $2, $3, $4)", minGames, keepCold,
+            static_cast<int64_t>(pruned.positions), static_cast<int64_t>(pruned.moves));
+        txn.commit();
+    }
+    // a DELETE only marks the rows dead. VACUUM lets their space be reused without locking
+    // out the readers. VACUUM FULL writes the tables and their indexes out again without them,
+    // so the files shrink, but it holds an exclusive lock for as long as that takes.
+    // Neither can run inside a transaction
+    std::string vacuumCommand = vacuumFull ? "VACUUM FULL ANALYZE " : "VACUUM ANALYZE ";
+    pqxx::nontransaction vacuum(conn);
+    vacuum.exec0(vacuumCommand + "lichess");
+    vacuum.exec0(vacuumCommand + "lichess_moves");
+    return pruned;
+}
+
+bool postgresStorage::applyDelta(const openingBook& delta, const std::string& month) {
+    return loader->applyDelta(delta, month);
+}
+
+std::unique_ptr<positionStorage> openPostgresStorage(const storageOptions& options) {
+    auto storage = std::make_unique<postgresStorage>(options);
+    // the keys have to be made the way the tables were loaded, like the lsm MANIFEST
+    std::optional<bool> canonical = storedCanonical(storage->conn);
+    if (!options.ingest) {
+        if (canonical) {
+            storage->canonicalKeys = *canonical;
+        }
+        return storage;
+    }
+    if (canonical && *canonical != options.canonical) {
+        std::cerr << "The database was loaded with canonicalPositions="
+            << (*canonical ? "true" : "false") << std::endl;
+        return nullptr;
+    }
+    if (options.initialLoad && !options.resume && !lichessIsEmpty(storage->conn)) {
+        std::cerr << "--initial-load needs an empty lichess table" << std::endl;
+        return nullptr;
+    }
+    // without them every flush would scan the tables, and the upserts have nothing to
+    // conflict on
+    if (!options.initialLoad && !hasIndexes(storage->conn)) {
+        std::cerr << "lichess_position_index or lichess_moves_pkey is missing. Finish the "
+            << "--initial-load by running it again with --resume, or see the Readme for a "
+            << "database from before the index" << std::endl;
+        return nullptr;
+    }
+    storage->loader = std::make_unique<postgresLoader>(storage->conn, options.source,
+        options.initialLoad, options.resume, options.storeFen, options.canonical);
+    ingestCheckpoint checkpoint;
+    if (options.initialLoad && options.resume && storage->loadCheckpoint(checkpoint) &&
+        checkpoint.byteOffset > 0 && !storage->loader->hasStagedRows()) {
+        std::cerr << "The staged rows of the initial load were lost, start it again"
+            << std::endl;
+        return nullptr;
+    }
+    return storage;
+}
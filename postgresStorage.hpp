@@ -0,0 +1,46 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <pqxx/pqxx>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+#include "positionStorage.hpp"
+#include "postgresLoader.hpp"
+
+// the lichess and lichess_moves tables. Ingest goes through postgresLoader
+class postgresStorage : public positionStorage {
+ public:
+    explicit postgresStorage(const storageOptions& options);
+    void flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint) override;
+    void finish() override;
+    bool loadCheckpoint(ingestCheckpoint& checkpoint) override;
+    bool getPosition(const positionKey& key, positionStats& stats) override;
+    // one query with position_key = ANY
+    std::vector<std::optional<positionStats>> getPositions(
+        const std::vector<positionKey>& keys) override;
+    std::vector<storedMove> getChildren(int64_t parentKey) override;
+    // one query with parent_key = ANY
+    std::vector<std::vector<storedMove>> getChildLists(
+        const std::vector<int64_t>& parentKeys) override;
+    // cold rows go to lichess_cold and lichess_moves_cold, and every prune is logged in
+    // lichess_prune_log. The tables are vacuumed afterwards, and rewritten with vacuumFull
+    pruneResult prune(int minGames, bool keepCold) override;
+    // months are recorded in lichess_applied_months
+    bool applyDelta(const openingBook& delta, const std::string& month) override;
+
+ private:
+    friend std::unique_ptr<positionStorage> openPostgresStorage(const storageOptions& options);
+
+    pqxx::connection conn;
+    std::string source;
+    bool vacuumFull;
+    // only made for an ingest, it creates the staging tables
+    std::unique_ptr<postgresLoader> loader;
+};
+
+// also refuses an initial load into a table that has rows, the resume of one whose staged
+// rows are gone, or an ingest with other canonicalPositions than the tables were loaded with.
+// A reader makes its keys the way the tables were loaded
+std::unique_ptr<positionStorage> openPostgresStorage(const storageOptions& options);
@@ -0,0 +1,106 @@
+// Copyright Andrew Bernal 2023
+#include "replay.hpp"
+#include <cctype>
+#include <string>
+#include <string_view>
+
+namespace {
+// index just past the matching close bracket, handling nested variations
+size_t skipVariation(std::string_view movetext, size_t i) {
+    int depth = 0;
+    while (i < movetext.size()) {
+        char c = movetext[i++];
+        if (c == '(') {
+            depth++;
+        } else if (c == ')') {
+            if (--depth == 0) {
+                break;
+            }
+        } else if (c == '{') {
+            while (i < movetext.size() && movetext[i] != '}') {
+                i++;
+            }
+        }
+    }
+    return i;
+}
+
+bool isTokenEnd(char c) {
+    return isspace(static_cast<unsigned char>(c)) || c == '{' || c == '(' || c == ')' || c == ';';
+}
+}  // namespace
+
+bool nextSanMove(std::string_view& movetext, std::string& san) {
+    size_t i = 0;
+    while (i < movetext.size()) {
+        char c = movetext[i];
+        if (c == '{') {
+            // comments, lichess puts [%eval] and [%clk] in here
+            size_t end = movetext.find('}', i);
+            i = end == std::string_view::npos ? movetext.size() : end + 1;
+        } else if (c == ';') {
+            size_t end = movetext.find('\n', i);
+            i = end == std::string_view::npos ? movetext.size() : end + 1;
+        } else if (c == '(') {
+            i = skipVariation(movetext, i);
+        } else if (c == '$') {
+            // NAG, e.g. $1
+            i++;
+            while (i < movetext.size() && isdigit(static_cast<unsigned char>(movetext[i]))) {
+                i++;
+            }
+        } else if (isdigit(static_cast<unsigned char>(c))) {
+            // either a move number (12. or 12...) or the result (1-0, 0-1, 1/2-1/2)
+            while (i < movetext.size() && isdigit(static_cast<unsigned char>(movetext[i]))) {
+                i++;
+            }
+            if (i < movetext.size() && (movetext[i] == '-' || movetext[i] == '/')) {
+                movetext = std::string_view();
+                return false;
+            }
+            while (i < movetext.size() && movetext[i] == '.') {
+                i++;
+            }
+        } else if (c == '*') {
+            movetext = std::string_view();
+            return false;
+        } else if (isalpha(static_cast<unsigned char>(c))) {
+            size_t start = i;
+            while (i < movetext.size() && !isTokenEnd(movetext[i])) {
+                i++;
+            }
+            // drop check, mate and annotation marks (e4+, Qxf7#, Nf3!?)
+            size_t end = i;
+            while (end > start && (movetext[end - 1] == '+' || movetext[end - 1] == '#' ||
+                movetext[end - 1] == '!' || movetext[end - 1] == '?')) {
+                end--;
+            }
+            san.assign(movetext.data() + start, end - start);
+            movetext.remove_prefix(i);
+            return true;
+        } else {
+            i++;
+        }
+    }
+    movetext = std::string_view();
+    return false;
+}
+
+int replayGame(std::string_view movetext, const replayCallback& onPosition) {
+    thc::ChessRules cr;
+    thc::Move mv;
+    std::string san;
+    int halfMoves = 0;
+    while (nextSanMove(movetext, san)) {
+        if (!mv.NaturalInFast(&cr, san.c_str())) {
+            // corrupt or non-standard movetext. Keep what was played up to here
+            break;
+        }
+        onPosition(cr, mv, san);
+        cr.PlayMove(mv);
+        halfMoves++;
+    }
+    mv.Invalid();
+    onPosition(cr, mv, "");
+    return halfMoves;
+}
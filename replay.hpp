@@ -0,0 +1,19 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <functional>
+#include <string>
+#include <string_view>
+#include "thc.h"
+
+// called once per half-move with the position before the move, the move, and its SAN.
+// After the last move it is called once more with the final position, an invalid move and ""
+using replayCallback = std::function<void(thc::ChessRules& position, const thc::Move& move,
+    const std::string& san)>;
+
+// pulls the next SAN move out of the movetext, skipping move numbers, comments, NAGs,
+// variations and annotation glyphs. Returns false at the end of the game
+bool nextSanMove(std::string_view& movetext, std::string& san);
+
+// replays the movetext of one game from the standard starting position
+// returns the number of half-moves played. Replay stops at the first move that can't be played
+int replayGame(std::string_view movetext, const replayCallback& onPosition);
@@ -0,0 +1,292 @@
+// Copyright Andrew Bernal 2023
+#include "sqliteStorage.hpp"
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+const char* createTables =
+    "CREATE TABLE IF NOT EXISTS positions (position_key INTEGER NOT NULL, board BLOB NOT NULL, "
+    "bucket INTEGER NOT NULL, white_wins INTEGER NOT NULL, black_wins INTEGER NOT NULL, "
+    "draws INTEGER NOT NULL, PRIMARY KEY (position_key, board, bucket)) WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS moves (parent_key INTEGER NOT NULL, move_code INTEGER NOT NULL, "
+    "child_key INTEGER NOT NULL, bucket INTEGER NOT NULL, white_wins INTEGER NOT NULL, "
+    "black_wins INTEGER NOT NULL, draws INTEGER NOT NULL, "
+    "PRIMARY KEY (parent_key, move_code, child_key, bucket)) WITHOUT ROWID;"
+    "CREATE TABLE IF NOT EXISTS ingest_checkpoint (source TEXT PRIMARY KEY, "
+    "byte_offset INTEGER NOT NULL, games INTEGER NOT NULL, post_bytes INTEGER NOT NULL);"
+    "CREATE TABLE IF NOT EXISTS applied_months (month TEXT PRIMARY KEY, "
+    "applied_at TEXT NOT NULL, positions INTEGER NOT NULL, moves INTEGER NOT NULL);"
+    "CREATE TABLE IF NOT EXISTS metadata (id INTEGER PRIMARY KEY CHECK (id = 1), "
+    "canonical INTEGER NOT NULL);";
+
+void bindStats(sqlite3_stmt* statement, int first, const positionStats& stats) {
+    sqlite3_bind_int64(statement, first, stats.whiteWins);
+    sqlite3_bind_int64(statement, first + 1, stats.blackWins);
+    sqlite3_bind_int64(statement, first + 2, stats.draws);
+}
+
+positionStats columnStats(sqlite3_stmt* statement, int first) {
+    return {sqlite3_column_int64(statement, first), sqlite3_column_int64(statement, first + 1),
+        sqlite3_column_int64(statement, first + 2)};
+}
+}  // namespace
+
+sqliteStorage::sqliteStorage(sqlite3* dbInp, const storageOptions& options)
+    : positionStorage(options.canonical, options.buckets), db(dbInp), source(options.source) {
+    // the WAL lets the repertoireBuilder read while the parser writes, and NORMAL only syncs
+    // at checkpoints, which is as much as the ingest checkpoints need
+    exec("PRAGMA journal_mode = WAL; PRAGMA synchronous = NORMAL;");
+    exec(createTables);
+    // the keys have to be made the way the file was loaded, like the lsm MANIFEST
+    sqlite3_stmt* selectCanonical = prepare("SELECT canonical FROM metadata");
+    bool recorded = sqlite3_step(selectCanonical) == SQLITE_ROW;
+    bool storedCanonical = recorded && sqlite3_column_int(selectCanonical, 0) != 0;
+    sqlite3_finalize(selectCanonical);
+    if (recorded && options.ingest && storedCanonical != canonicalKeys) {
+        throw std::runtime_error(options.sqliteLocation + " was loaded with "
+            "canonicalPositions=" + (storedCanonical ? "true" : "false"));
+    }
+    if (recorded) {
+        canonicalKeys = storedCanonical;
+    }
+    upsertPosition = prepare("INSERT INTO positions VALUES (?, ?, ?, ?, ?, ?) "
+        "ON CONFLICT (position_key, board, bucket) DO UPDATE SET "
+        "white_wins = white_wins + excluded.white_wins, "
+        "black_wins = black_wins + excluded.black_wins, draws = draws + excluded.draws");
+    upsertMove = prepare("INSERT INTO moves VALUES (?, ?, ?, ?, ?, ?, ?) "
+        "ON CONFLICT (parent_key, move_code, child_key, bucket) DO UPDATE SET "
+        "white_wins = white_wins + excluded.white_wins, "
+        "black_wins = black_wins + excluded.black_wins, draws = draws + excluded.draws");
+    upsertCheckpoint = prepare("INSERT OR REPLACE INTO ingest_checkpoint VALUES (?, ?, ?, ?)");
+    selectCheckpoint = prepare("SELECT byte_offset, games, post_bytes FROM ingest_checkpoint "
+        "WHERE source = ?");
+    insertMonth = prepare("INSERT OR IGNORE INTO applied_months "
+        "VALUES (?, datetime('now'), ?, ?)");
+    // the buckets that were asked for are summed in the query
+    selectPosition = prepare(("SELECT count(*), sum(white_wins), sum(black_wins), sum(draws) "
+        "FROM positions WHERE position_key = ? AND board = ?" + bucketFilter()).c_str());
+    selectChildren = prepare(("SELECT move_code, child_key, sum(white_wins), sum(black_wins), "
+        "sum(draws) FROM moves WHERE parent_key = ?" + bucketFilter() +
+        " GROUP BY move_code, child_key").c_str());
+}
+
+sqliteStorage::~sqliteStorage() {
+    for (sqlite3_stmt* statement : {upsertPosition, upsertMove, upsertCheckpoint,
+        selectCheckpoint, insertMonth, selectPosition, selectChildren}) {
+        sqlite3_finalize(statement);
+    }
+    sqlite3_close(db);
+}
+
+void sqliteStorage::exec(const char* sql) {
+    char* error = nullptr;
+    if (sqlite3_exec(db, sql, nullptr, nullptr, &error) != SQLITE_OK) {
+        std::string message = error ? error : sqlite3_errmsg(db);
+        sqlite3_free(error);
+        throw std::runtime_error("sqlite: " + message);
+    }
+}
+
+sqlite3_stmt* sqliteStorage::prepare(const char* sql) {
+    sqlite3_stmt* statement = nullptr;
+    if (sqlite3_prepare_v2(db, sql, -1, &statement, nullptr) != SQLITE_OK) {
+        throw std::runtime_error(std::string("sqlite: ") + sqlite3_errmsg(db));
+    }
+    return statement;
+}
+
+void sqliteStorage::writePosition(int64_t key, const void* board, gameBucket bucket,
+    const positionStats& stats) {
+    sqlite3_bind_int64(upsertPosition, 1, key);
+    sqlite3_bind_blob(upsertPosition, 2, board, sizeof(thc::CompressedPosition::storage),
+        SQLITE_STATIC);
+    sqlite3_bind_int(upsertPosition, 3, bucket);
+    bindStats(upsertPosition, 4, stats);
+    if (sqlite3_step(upsertPosition) != SQLITE_DONE) {
+        throw std::runtime_error(std::string("sqlite: ") + sqlite3_errmsg(db));
+    }
+    sqlite3_reset(upsertPosition);
+}
+
+void sqliteStorage::writeMove(int64_t parentKey, moveCode move, int64_t childKey,
+    gameBucket bucket, const positionStats& stats) {
+    sqlite3_bind_int64(upsertMove, 1, parentKey);
+    sqlite3_bind_int(upsertMove, 2, move);
+    sqlite3_bind_int64(upsertMove, 3, childKey);
+    sqlite3_bind_int(upsertMove, 4, bucket);
+    bindStats(upsertMove, 5, stats);
+    if (sqlite3_step(upsertMove) != SQLITE_DONE) {
+        throw std::runtime_error(std::string("sqlite: ") + sqlite3_errmsg(db));
+    }
+    sqlite3_reset(upsertMove);
+}
+
+void sqliteStorage::recordCanonical() {
+    exec(canonicalKeys ? "INSERT OR IGNORE INTO metadata VALUES (1, 1)" :
+        "INSERT OR IGNORE INTO metadata VALUES (1, 0)");
+}
+
+void sqliteStorage::flush(const positionAggregate& aggregate,
+    const ingestCheckpoint& checkpoint) {
+    exec("BEGIN");
+    try {
+        for (const auto& [key, stats] : aggregate.positions) {
+            writePosition(databaseKey(key.key), key.key.board.storage, key.bucket, stats);
+        }
+        for (const auto& [edge, stats] : aggregate.moves) {
+            writeMove(edge.parentKey, edge.move, edge.childKey, edge.bucket, stats);
+        }
+        sqlite3_bind_text(upsertCheckpoint, 1, source.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(upsertCheckpoint, 2, checkpoint.byteOffset);
+        sqlite3_bind_int64(upsertCheckpoint, 3, checkpoint.games);
+        sqlite3_bind_int64(upsertCheckpoint, 4, checkpoint.postBytes);
+        if (sqlite3_step(upsertCheckpoint) != SQLITE_DONE) {
+            throw std::runtime_error(std::string("sqlite: ") + sqlite3_errmsg(db));
+        }
+        sqlite3_reset(upsertCheckpoint);
+        recordCanonical();
+    } catch (...) {
+        sqlite3_reset(upsertPosition);
+        sqlite3_reset(upsertMove);
+        sqlite3_reset(upsertCheckpoint);
+        exec("ROLLBACK");
+        throw;
+    }
+    exec("COMMIT");
+}
+
+bool sqliteStorage::applyDelta(const openingBook& delta, const std::string& month) {
+    exec("BEGIN");
+    try {
+        // claiming the month is the first write, so it takes the write lock and no other run
+        // can apply it in the meantime
+        sqlite3_bind_text(insertMonth, 1, month.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(insertMonth, 2, delta.positionCount());
+        sqlite3_bind_int64(insertMonth, 3, delta.moveCount());
+        if (sqlite3_step(insertMonth) != SQLITE_DONE) {
+            throw std::runtime_error(std::string("sqlite: ") + sqlite3_errmsg(db));
+        }
+        sqlite3_reset(insertMonth);
+        if (sqlite3_changes(db) == 0) {
+            exec("ROLLBACK");
+            return false;
+        }
+        // the delta is in primary key order, so the upserts walk the b-trees front to back
+        // and only touch each page once
+        const bookPosition* positions = delta.positionData();
+        for (uint64_t i = 0; i < delta.positionCount(); i++) {
+            const bookPosition& position = positions[i];
+            writePosition(position.key, position.board, position.bucket,
+                {position.whiteWins, position.blackWins, position.draws});
+        }
+        const bookMove* moves = delta.moveData();
+        for (uint64_t i = 0; i < delta.moveCount(); i++) {
+            const bookMove& edge = moves[i];
+            writeMove(edge.parentKey, edge.move, edge.childKey, edge.bucket,
+                {edge.whiteWins, edge.blackWins, edge.draws});
+        }
+        recordCanonical();
+    } catch (...) {
+        sqlite3_reset(insertMonth);
+        sqlite3_reset(upsertPosition);
+        sqlite3_reset(upsertMove);
+        exec("ROLLBACK");
+        throw;
+    }
+    exec("COMMIT");
+    return true;
+}
+
+bool sqliteStorage::loadCheckpoint(ingestCheckpoint& checkpoint) {
+    sqlite3_bind_text(selectCheckpoint, 1, source.c_str(), -1, SQLITE_TRANSIENT);
+    bool found = sqlite3_step(selectCheckpoint) == SQLITE_ROW;
+    if (found) {
+        checkpoint.byteOffset = sqlite3_column_int64(selectCheckpoint, 0);
+        checkpoint.games = sqlite3_column_int64(selectCheckpoint, 1);
+        checkpoint.postBytes = sqlite3_column_int64(selectCheckpoint, 2);
+    }
+    sqlite3_reset(selectCheckpoint);
+    return found;
+}
+
+bool sqliteStorage::getPosition(const positionKey& key, positionStats& stats) {
+    sqlite3_bind_int64(selectPosition, 1, databaseKey(key));
+    sqlite3_bind_blob(selectPosition, 2, key.board.storage, sizeof(key.board.storage),
+        SQLITE_STATIC);
+    // an aggregate always returns a row, the count says whether anything matched
+    bool found = sqlite3_step(selectPosition) == SQLITE_ROW &&
+        sqlite3_column_int(selectPosition, 0) > 0;
+    if (found) {
+        stats = columnStats(selectPosition, 1);
+    }
+    sqlite3_reset(selectPosition);
+    return found;
+}
+
+std::vector<storedMove> sqliteStorage::getChildren(int64_t parentKey) {
+    std::vector<storedMove> children;
+    sqlite3_bind_int64(selectChildren, 1, parentKey);
+    while (sqlite3_step(selectChildren) == SQLITE_ROW) {
+        children.push_back({static_cast<moveCode>(sqlite3_column_int(selectChildren, 0)),
+            sqlite3_column_int64(selectChildren, 1), columnStats(selectChildren, 2)});
+    }
+    sqlite3_reset(selectChildren);
+    return children;
+}
+
+pruneResult sqliteStorage::prune(int minGames, bool keepCold) {
+    // the total of a position or move is over all of its buckets
+    std::string having = " HAVING sum(white_wins + black_wins + draws) < " +
+        std::to_string(minGames) + ")";
+    std::string positionsWhere = " WHERE (position_key, board) IN (SELECT position_key, board "
+        "FROM positions GROUP BY position_key, board" + having;
+    std::string movesWhere = " WHERE (parent_key, move_code, child_key) IN (SELECT parent_key, "
+        "move_code, child_key FROM moves GROUP BY parent_key, move_code, child_key" + having;
+    pruneResult pruned;
+    exec("BEGIN");
+    try {
+        if (keepCold) {
+            exec("CREATE TABLE IF NOT EXISTS positions_cold AS SELECT * FROM positions WHERE 0;"
+                "CREATE TABLE IF NOT EXISTS moves_cold AS SELECT * FROM moves WHERE 0");
+            exec(("INSERT INTO positions_cold SELECT * FROM positions" + positionsWhere).c_str());
+            exec(("INSERT INTO moves_cold SELECT * FROM moves" + movesWhere).c_str());
+        }
+        exec(("DELETE FROM positions" + positionsWhere).c_str());
+        pruned.positions = sqlite3_changes(db);
+        exec(("DELETE FROM moves" + movesWhere).c_str());
+        pruned.moves = sqlite3_changes(db);
+    } catch (...) {
+        exec("ROLLBACK");
+        throw;
+    }
+    exec("COMMIT");
+    // gives the freed pages back, the way VACUUM FULL does in postgres
+    exec("VACUUM");
+    return pruned;
+}
+
+std::unique_ptr<positionStorage> openSqliteStorage(const storageOptions& options) {
+    sqlite3* db = nullptr;
+    int flags = options.ingest ? SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE :
+        SQLITE_OPEN_READWRITE;
+    if (sqlite3_open_v2(options.sqliteLocation.c_str(), &db, flags, nullptr) != SQLITE_OK) {
+        std::cerr << "Failed to open " << options.sqliteLocation << ": " << sqlite3_errmsg(db)
+            << std::endl;
+        sqlite3_close(db);
+        return nullptr;
+    }
+    // a writer holding the lock makes readers wait instead of failing
+    sqlite3_busy_timeout(db, 10000);
+    try {
+        return std::make_unique<sqliteStorage>(db, options);
+    } catch (const std::exception& e) {
+        std::cerr << e.what() << std::endl;
+        // close_v2 waits for the statements that were prepared before the failure
+        sqlite3_close_v2(db);
+        return nullptr;
+    }
+}
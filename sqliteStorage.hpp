@@ -0,0 +1,50 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <sqlite3.h>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+#include "positionStorage.hpp"
+
+// one sqlite file, for running both programs on a single machine without a postgres server.
+// The tables are WITHOUT ROWID, so each row lives in its primary key's b-tree
+class sqliteStorage : public positionStorage {
+ public:
+    sqliteStorage(sqlite3* dbInp, const storageOptions& options);
+    sqliteStorage(const sqliteStorage&) = delete;
+    sqliteStorage& operator=(const sqliteStorage&) = delete;
+    ~sqliteStorage();
+    // every row and the checkpoint in one transaction
+    void flush(const positionAggregate& aggregate, const ingestCheckpoint& checkpoint) override;
+    bool loadCheckpoint(ingestCheckpoint& checkpoint) override;
+    bool getPosition(const positionKey& key, positionStats& stats) override;
+    std::vector<storedMove> getChildren(int64_t parentKey) override;
+    // cold rows go to positions_cold and moves_cold, and the file is vacuumed afterwards
+    pruneResult prune(int minGames, bool keepCold) override;
+    // upserts the delta in key order, in one transaction with its row in applied_months
+    bool applyDelta(const openingBook& delta, const std::string& month) override;
+
+ private:
+    void exec(const char* sql);
+    sqlite3_stmt* prepare(const char* sql);
+    // one row of the upserts. Throws if sqlite fails
+    void writePosition(int64_t key, const void* board, gameBucket bucket,
+        const positionStats& stats);
+    void writeMove(int64_t parentKey, moveCode move, int64_t childKey, gameBucket bucket,
+        const positionStats& stats);
+    // records the canonicalPositions of the keys in metadata, unless something already is
+    void recordCanonical();
+
+    sqlite3* db;
+    std::string source;
+    sqlite3_stmt* upsertPosition;
+    sqlite3_stmt* upsertMove;
+    sqlite3_stmt* upsertCheckpoint;
+    sqlite3_stmt* selectCheckpoint;
+    sqlite3_stmt* insertMonth;
+    sqlite3_stmt* selectPosition;
+    sqlite3_stmt* selectChildren;
+};
+
+std::unique_ptr<positionStorage> openSqliteStorage(const storageOptions& options);
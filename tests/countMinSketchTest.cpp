@@ -0,0 +1,30 @@
+// Copyright Andrew Bernal 2023
+#include <cassert>
+#include <cstdint>
+#include "countMinSketch.hpp"
+
+int main() {
+    countMinSketch sketch(1 << 20);
+    for (int i = 0; i < 3; i++) {
+        sketch.add(42);
+    }
+    // far more than the counters hold
+    for (int i = 0; i < 1000; i++) {
+        sketch.add(-7);
+    }
+    // a few thousand keys in a megabyte can't push every row of a key past its real count
+    for (int64_t key = 1000; key < 4000; key++) {
+        sketch.add(key);
+    }
+    assert(sketch.estimate(42) == 3);
+    assert(sketch.estimate(-7) == countMinSketch::maxCount);
+    assert(sketch.estimate(1000) >= 1);
+    assert(sketch.total() == 3 + 1000 + 3000);
+
+    // a saturated counter stays saturated, it doesn't wrap around to a small count
+    for (unsigned int i = 0; i < countMinSketch::maxCount; i++) {
+        sketch.add(-7);
+    }
+    assert(sketch.estimate(-7) == countMinSketch::maxCount);
+    return 0;
+}
@@ -0,0 +1,69 @@
+// Copyright Andrew Bernal 2023
+#include <stdlib.h>
+#include <cassert>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "lsmStorage.hpp"
+#include "openingBook.hpp"
+
+int main() {
+    char directory[] = "/tmp/lsmStorageTestXXXXXX";
+    assert(mkdtemp(directory) != nullptr);
+    thc::ChessRules start;
+    positionKey startKey = makePositionKey(start, false);
+
+    {
+        storageOptions options;
+        options.kind = "lsm";
+        options.lsmLocation = directory;
+        options.ingest = true;
+        options.source = "test.pgn";
+        lsmStorage storage(options);
+        storage.open();
+        // five runs: the first four are merged in the background, and the export merges that
+        // run with the fifth. The same record in several runs has to come out once, summed
+        for (int run = 0; run < 5; run++) {
+            positionAggregate aggregate;
+            for (int game = 0; game <= run; game++) {
+                addPosition(aggregate, startKey, 1, whiteWin);
+            }
+            addMove(aggregate, 1, 5, 2, 1, draw);
+            if (run == 2) {
+                addMove(aggregate, 1, 5, 2, 3, blackWin);
+            }
+            if (run == 4) {
+                addMove(aggregate, 1, 6, 3, 1, draw);
+            }
+            ingestCheckpoint checkpoint;
+            checkpoint.byteOffset = run;
+            storage.flush(aggregate, checkpoint);
+        }
+        storage.finish();
+
+        positionStats stats;
+        assert(storage.getPosition(startKey, stats));
+        assert(stats.whiteWins == 1 + 2 + 3 + 4 + 5);
+        assert(stats.blackWins == 0 && stats.draws == 0);
+
+        storage.exportBook(std::string(directory) + "/export.book");
+    }
+
+    openingBook book;
+    assert(book.open(std::string(directory) + "/export.book"));
+    bookPositionRange positions = book.findPosition(startKey);
+    assert(positions.last - positions.first == 1);
+    assert(positions.first->whiteWins == 15);
+    assert(positions.first->bucket == 1);
+    // sorted by move, child and bucket, with the counts of every run added up
+    bookMoveRange moves = book.findMoves(1);
+    std::vector<bookMove> found(moves.begin(), moves.end());
+    assert(found.size() == 3);
+    assert(found[0].move == 5 && found[0].bucket == 1 && found[0].draws == 5);
+    assert(found[0].whiteWins == 0 && found[0].blackWins == 0);
+    assert(found[1].move == 5 && found[1].bucket == 3 && found[1].blackWins == 1);
+    assert(found[2].move == 6 && found[2].childKey == 3 && found[2].draws == 1);
+
+    std::filesystem::remove_all(directory);
+    return 0;
+}
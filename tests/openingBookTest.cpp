@@ -0,0 +1,54 @@
+// Copyright Andrew Bernal 2023
+#include <unistd.h>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "openingBook.hpp"
+
+int main() {
+    char path[] = "/tmp/openingBookTestXXXXXX";
+    int fd = mkstemp(path);
+    assert(fd != -1);
+    close(fd);
+
+    // parents 0, 10, ... 90, parent p with p / 10 + 1 moves. With a fence every 4 moves a
+    // parent's moves start in the middle of a block, and some run over into the next one
+    const uint32_t stride = 4;
+    uint8_t board[24] = {};
+    uint64_t moves = 0;
+    openingBookWriter writer(std::fopen(path, "wb"), false, stride);
+    for (int64_t key = 0; key < 100; key += 10) {
+        writer.addPosition(key, board, 0, positionStats{key, 0, 0});
+    }
+    for (int64_t parent = 0; parent < 100; parent += 10) {
+        for (int64_t child = 0; child <= parent / 10; child++) {
+            writer.addMove(parent, static_cast<moveCode>(child + 1), child, 0,
+                positionStats{parent, child, 0});
+            moves++;
+        }
+    }
+    assert(writer.finish());
+
+    openingBook book;
+    assert(book.open(path));
+    assert(book.moveCount() == moves);
+    for (int64_t parent = 0; parent < 100; parent += 10) {
+        bookMoveRange range = book.findMoves(parent);
+        assert(range.last - range.first == parent / 10 + 1);
+        int64_t child = 0;
+        for (const bookMove& move : range) {
+            assert(move.parentKey == parent);
+            assert(move.childKey == child);
+            assert(move.whiteWins == parent);
+            child++;
+        }
+    }
+    // keys before, between and after the stored ones have no moves
+    for (int64_t missing : {int64_t(-5), int64_t(5), int64_t(45), int64_t(95)}) {
+        bookMoveRange range = book.findMoves(missing);
+        assert(range.first == range.last);
+    }
+    std::remove(path);
+    return 0;
+}
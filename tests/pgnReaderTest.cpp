@@ -0,0 +1,64 @@
+// Copyright Andrew Bernal 2023
+#include <cassert>
+#include <string>
+#include <string_view>
+#include "pgnReader.hpp"
+
+namespace {
+// the second game has "[Event " in a comment, which isn't at the start of a line
+const char games[] =
+    "[Event \"Rated Blitz game\"]\n[Result \"1-0\"]\n\n"
+    "1. e4 e5 2. Qh5 Nc6 3. Bc4 Nf6 4. Qxf7# 1-0\n"
+    "\n"
+    "[Event \"Rated Bullet game\"]\n[Result \"0-1\"]\n\n"
+    "1. f3 { not [Event \"x\"] } e5 2. g4 Qh4# 0-1\n"
+    "\n"
+    "[Event \"Rated Rapid game\"]\n[Result \"1/2-1/2\"]\n\n1. d4 d5 1/2-1/2\n";
+
+// the same text, but read() a few bytes at a time like a file instead of mapped
+class streamedSource : public memorySource {
+ public:
+    explicit streamedSource(std::string_view textInp) : memorySource(textInp) {}
+    std::string_view mapped() override { return std::string_view(); }
+};
+
+// every chunk has to start with a game, and together they are the whole input
+void checkChunks(pgnSource& source, size_t blockSize, size_t chunkSize, int expectedChunks) {
+    pgnReader reader(source, blockSize);
+    pgnChunk chunk;
+    std::string joined;
+    int chunks = 0;
+    while (reader.nextChunk(chunk, chunkSize)) {
+        assert(chunk.text().rfind("[Event ", 0) == 0);
+        assert(chunk.sequence == chunks);
+        joined += chunk.text();
+        assert(chunk.endOffset == joined.size());
+        chunks++;
+    }
+    assert(!reader.failed());
+    assert(joined == games);
+    assert(chunks == expectedChunks);
+}
+}  // namespace
+
+int main() {
+    // a chunk goes on to the next game that starts after chunkSize bytes
+    memorySource small(games);
+    checkChunks(small, 64 << 20, 1, 3);
+    memorySource whole(games);
+    checkChunks(whole, 64 << 20, sizeof(games), 1);
+    // a block that ends partway through a game is kept and read on from
+    streamedSource streamed(games);
+    checkChunks(streamed, 16, 1, 3);
+
+    // the games themselves are cut the same way
+    memorySource source(games);
+    pgnReader reader(source);
+    pgnGame game;
+    int count = 0;
+    while (reader.nextGame(game)) {
+        count++;
+    }
+    assert(count == 3);
+    return 0;
+}
@@ -0,0 +1,38 @@
+// Copyright Andrew Bernal 2023
+#include <cassert>
+#include <string>
+#include <vector>
+#include "replay.hpp"
+
+int main() {
+    // 2...Qxe4 can't be played, so the replay stops before it and keeps the moves until then
+    std::vector<std::string> played;
+    int finalCalls = 0;
+    std::string finalFen;
+    int halfMoves = replayGame("1. e4 { [%clk 0:03:00] } e5 2. Nf3 Qxe4 3. Nc3 0-1",
+        [&](thc::ChessRules& position, const thc::Move&, const std::string& san) {
+            if (!san.empty()) {
+                played.push_back(san);
+            } else {
+                finalCalls++;
+                finalFen = position.ForsythPublish();
+            }
+        });
+    assert(halfMoves == 3);
+    assert((played == std::vector<std::string>{"e4", "e5", "Nf3"}));
+    // the final position is still handed out once, after the last move that was played
+    assert(finalCalls == 1);
+    assert(finalFen == "rnbqkbnr/pppp1ppp/8/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R b KQkq - 1 2");
+
+    // a legal game is played to its result, through comments, NAGs and variations
+    played.clear();
+    halfMoves = replayGame("1. e4 $1 (1. d4 d5) 1... e5 2. Qh5?! Nc6 3. Bc4 Nf6?? 4. Qxf7# 1-0",
+        [&](thc::ChessRules&, const thc::Move&, const std::string& san) {
+            if (!san.empty()) {
+                played.push_back(san);
+            }
+        });
+    assert(halfMoves == 7);
+    assert(played.back() == "Qxf7");
+    return 0;
+}
@@ -0,0 +1,48 @@
+// Copyright Andrew Bernal 2023
+#include <atomic>
+#include <cassert>
+#include <thread>
+#include <vector>
+#include "workStealingPool.hpp"
+
+int main() {
+    // every task of depth d spawns two of depth d - 1, so one task of depth 10 is 2047 tasks.
+    // They are all pushed to the first worker, the others only get work by stealing it
+    const size_t workers = 4;
+    const int depth = 10;
+    workStealingPool<int> pool(workers);
+    pool.push(0, depth);
+    std::atomic<int> tasksRun(0);
+    std::vector<int> tasksPerWorker(workers, 0);
+    std::vector<std::thread> threads;
+    for (size_t worker = 0; worker < workers; worker++) {
+        threads.emplace_back([&, worker] {
+            int task;
+            while (pool.pop(worker, task)) {
+                if (task > 0) {
+                    pool.push(worker, task - 1);
+                    pool.push(worker, task - 1);
+                }
+                tasksRun++;
+                tasksPerWorker[worker]++;
+                pool.done();
+            }
+        });
+    }
+    // every pop returns false once the last task is done, so the workers all stop
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    assert(tasksRun == (1 << (depth + 1)) - 1);
+    int total = 0;
+    for (int count : tasksPerWorker) {
+        total += count;
+    }
+    assert(total == tasksRun);
+
+    // with nothing pushed there is nothing to wait for
+    workStealingPool<int> empty(2);
+    int task;
+    assert(!empty.pop(1, task));
+    return 0;
+}
@@ -0,0 +1,54 @@
+// Copyright Andrew Bernal 2023
+#include <zstd.h>
+#include <cassert>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "pgnSource.hpp"
+
+namespace {
+const std::string pgn =
+    "[Event \"Rated Blitz game\"]\n[Result \"1-0\"]\n\n"
+    "1. e4 e5 2. Qh5 Nc6 3. Bc4 Nf6 4. Qxf7# 1-0\n";
+
+// a temporary file holding the first size bytes of data
+std::FILE* fileWith(const std::vector<char>& data, size_t size) {
+    std::FILE* file = std::tmpfile();
+    assert(file != nullptr);
+    assert(std::fwrite(data.data(), 1, size, file) == size);
+    std::rewind(file);
+    return file;
+}
+
+std::string readAll(pgnSource& source) {
+    std::string text;
+    char buf[7];
+    size_t bytes;
+    while ((bytes = source.read(buf, sizeof(buf))) > 0) {
+        text.append(buf, bytes);
+    }
+    return text;
+}
+}  // namespace
+
+int main() {
+    std::vector<char> compressed(ZSTD_compressBound(pgn.size()));
+    size_t size = ZSTD_compress(compressed.data(), compressed.size(), pgn.data(), pgn.size(), 3);
+    assert(!ZSTD_isError(size));
+
+    zstdSource complete(fileWith(compressed, size));
+    assert(readAll(complete) == pgn);
+    assert(!complete.failed());
+
+    // a partial download stops partway through the frame, which mustn't look like the end
+    zstdSource truncated(fileWith(compressed, size - 4));
+    assert(readAll(truncated).size() < pgn.size());
+    assert(truncated.failed());
+
+    // and so does garbage
+    std::vector<char> garbage(64, 'x');
+    zstdSource corrupt(fileWith(garbage, garbage.size()));
+    assert(readAll(corrupt).empty());
+    assert(corrupt.failed());
+    return 0;
+}
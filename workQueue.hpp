@@ -0,0 +1,56 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// bounded queue between the reader, the worker threads and the database writer.
+// push blocks while the queue is full, so a slow consumer holds back the producer
+template <typename T>
+class workQueue {
+ public:
+    explicit workQueue(size_t capacityInp) : capacity(capacityInp) {}
+
+    // false if the queue was closed (the item is dropped), so a producer stops when the
+    // consumer gave up
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return items.size() < capacity || closed; });
+        if (closed) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // false once the queue is closed and everything in it has been handed out
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return !items.empty() || closed; });
+        if (items.empty()) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    // no more items will be pushed, and pushes waiting for room give up
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+ private:
+    size_t capacity;
+    std::deque<T> items;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+};
@@ -0,0 +1,87 @@
+// Copyright Andrew Bernal 2023
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+// tasks that spawn more tasks, for a fixed set of workers. Each worker takes its own newest
+// task first, so it goes on with the subtree it just expanded. A worker with nothing to do
+// steals the oldest task of another, which is the root of the biggest subtree it has left
+template <typename T>
+class workStealingPool {
+ public:
+    explicit workStealingPool(size_t workers) : queues(workers) {}
+
+    void push(size_t worker, T task) {
+        outstanding++;
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            queues[worker].tasks.push_back(std::move(task));
+        }
+        std::lock_guard<std::mutex> lock(idleMutex);
+        idle.notify_one();
+    }
+
+    // false once every task has been done. Waits while there is nothing to take but the
+    // tasks being run could still push more
+    bool pop(size_t worker, T& task) {
+        while (true) {
+            if (take(worker, task)) {
+                return true;
+            }
+            std::unique_lock<std::mutex> lock(idleMutex);
+            if (outstanding == 0) {
+                return false;
+            }
+            // a push between the take and the wait would be missed otherwise
+            if (take(worker, task)) {
+                return true;
+            }
+            idle.wait(lock);
+        }
+    }
+
+    // the worker has finished a task it popped, and pushed everything it spawned
+    void done() {
+        if (--outstanding == 0) {
+            std::lock_guard<std::mutex> lock(idleMutex);
+            idle.notify_all();
+        }
+    }
+
+ private:
+    struct taskQueue {
+        std::mutex mutex;
+        std::deque<T> tasks;
+    };
+
+    bool take(size_t worker, T& task) {
+        {
+            std::lock_guard<std::mutex> lock(queues[worker].mutex);
+            if (!queues[worker].tasks.empty()) {
+                task = std::move(queues[worker].tasks.back());
+                queues[worker].tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); i++) {
+            taskQueue& victim = queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                task = std::move(victim.tasks.front());
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<taskQueue> queues;
+    // tasks pushed and not done yet
+    std::atomic<size_t> outstanding{0};
+    std::mutex idleMutex;
+    std::condition_variable idle;
+};